@@ -1,7 +1,78 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <dlfcn.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include "yoda.h"
+
+// --- Memory and Diagnostics ---
+
+// All tokenizer and parser memory goes through the caller's allocator when
+// one is given (see yoda.h), otherwise through libc.
+static void* yoda_realloc(const YodaAllocator* allocator, void* ptr, size_t size) {
+    if (allocator) return allocator->realloc(allocator->ctx, ptr, size);
+    if (size == 0) { free(ptr); return NULL; }
+    return realloc(ptr, size);
+}
+
+static void yoda_free(const YodaAllocator* allocator, void* ptr) {
+    if (ptr) yoda_realloc(allocator, ptr, 0);
+}
+
+// Reports one error line. With no diagnostics set it goes to stdout, as
+// the command line tool has always done. Longer messages are truncated.
+static void report_diagnostic(const YodaDiagnostics* diagnostics, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (diagnostics) {
+        char message[1024];
+        vsnprintf(message, sizeof(message), format, args);
+        diagnostics->report(diagnostics->ctx, message);
+    } else {
+        vprintf(format, args);
+        putchar('\n');
+    }
+    va_end(args);
+}
+
+#ifndef YODA_NO_MAIN
+// YodaDiagnostics callback writing each line to the FILE* in ctx.
+static void write_diagnostic_to_file(void* file, const char* message) {
+    fprintf(file, "%s\n", message);
+}
+#endif
+
+static void discard_diagnostic(void* ctx, const char* message) {
+    (void)ctx;
+    (void)message;
+}
+
+static const YodaDiagnostics quiet_diagnostics = {discard_diagnostic, NULL};
 
 // --- Tokenizer Section ---
 
@@ -17,489 +88,5113 @@ typedef enum {
     TOKEN_EQUALS,
     TOKEN_SEMICOLON,
     TOKEN_COMMA,
+    TOKEN_OPERATOR,    // + - * / % ! == != < > <= >= && ||
     TOKEN_PREPROCESSOR,
     TOKEN_EOF,
     TOKEN_UNKNOWN
 } TokenType;
 
-// Keywords
-const char* keywords[] = {"int", "void", "char", "for", "while", "if", "else", "return"};
-const int num_keywords = sizeof(keywords) / sizeof(char*);
+#define NUM_TOKEN_TYPES (TOKEN_UNKNOWN + 1)
+
+// Keywords. Their IDs are their positions here, 0 to NUM_KEYWORDS - 1.
+#define KEYWORDS(X) \
+    X(INT, "int") X(VOID, "void") X(CHAR, "char") X(FOR, "for") \
+    X(WHILE, "while") X(IF, "if") X(ELSE, "else") X(RETURN, "return")
+
+enum {
+#define KEYWORD_ENUM(name, text) KEYWORD_##name,
+    KEYWORDS(KEYWORD_ENUM)
+#undef KEYWORD_ENUM
+    NUM_KEYWORDS
+};
 
-// Token struct to hold type and the actual text (lexeme)
+static const char* keywords[NUM_KEYWORDS] = {
+#define KEYWORD_TEXT(name, text) text,
+    KEYWORDS(KEYWORD_TEXT)
+#undef KEYWORD_TEXT
+};
+
+// A token as the lexer returns it and the parser reads it: its type and
+// the actual text (lexeme). The lexeme is a slice of the source buffer
+// (offset + length), not a copy, so the source must outlive the token
+// list. Keywords carry their ID, so the parser tells them apart with
+// integer compares; other tokens have -1. The fields are packed into 16
+// bytes, which x86-64 passes and returns in two registers. Identifier IDs
+// (see SymbolTable) are stored beside the token rather than in it.
 typedef struct {
-    TokenType type;
-    char* lexeme;
+    uint8_t type;      // TokenType
+    int8_t keyword;
+    int length;
+    size_t offset;
 } Token;
 
-// A dynamic array to store tokens
+// Tokens are stored as parallel arrays (21 bytes a token), so scans over
+// types and bracket partners read dense memory. The arrays share one
+// allocation, which starts at offsets.
 typedef struct {
-    Token* tokens;
+    const char* source;
+    uint8_t* types;
+    uint64_t* offsets;
+    uint32_t* lengths;
+    int32_t* partners;
+    int32_t* symbols; // keyword or identifier ID, -1 for other tokens
     int count;
     int capacity;
+    int grow_events; // reallocations of the arrays, for --stats
 } TokenList;
 
-void add_token(TokenList* list, TokenType type, const char* lexeme, int len) {
-    if (list->count >= list->capacity) {
-        list->capacity = list->capacity == 0 ? 8 : list->capacity * 2;
-        list->tokens = realloc(list->tokens, list->capacity * sizeof(Token));
+#define TOKEN_BYTES (sizeof(uint64_t) + 3 * sizeof(uint32_t) + sizeof(uint8_t))
+
+static Token get_token(const TokenList* list, int index) {
+    int symbol = list->symbols[index];
+    return (Token){list->types[index], (unsigned int)symbol < NUM_KEYWORDS ? symbol : -1, list->lengths[index],
+                   list->offsets[index]};
+}
+
+// For brackets, partner is the position of the matching bracket (-1 if
+// unmatched or not yet lexed).
+static void set_token(TokenList* list, int index, Token token, int partner, int symbol) {
+    list->types[index] = token.type;
+    list->offsets[index] = token.offset;
+    list->lengths[index] = token.length;
+    list->partners[index] = partner;
+    list->symbols[index] = symbol;
+}
+
+// Moves the tokens at positions [from, to) into arrays of capacity
+// entries. A ring (capacity a power of two) keeps position pos at index
+// pos & (capacity - 1), a plain list at pos. Returns 0, leaving list
+// unchanged, if memory runs out.
+static int resize_tokens(TokenList* list, int capacity, int from, int to, int ring, const YodaAllocator* allocator) {
+    uint8_t* block = yoda_realloc(allocator, NULL, (size_t)capacity * TOKEN_BYTES);
+    if (!block) return 0;
+    TokenList resized = *list;
+    resized.offsets = (uint64_t*)block;
+    resized.lengths = (uint32_t*)(resized.offsets + capacity);
+    resized.partners = (int32_t*)(resized.lengths + capacity);
+    resized.symbols = resized.partners + capacity;
+    resized.types = (uint8_t*)(resized.symbols + capacity);
+    resized.capacity = capacity;
+    for (int pos = from; pos < to; pos++) {
+        int index = ring ? pos & (list->capacity - 1) : pos;
+        set_token(&resized, ring ? pos & (capacity - 1) : pos, get_token(list, index), list->partners[index],
+                  list->symbols[index]);
     }
-    char* token_lexeme = malloc(len + 1);
-    strncpy(token_lexeme, lexeme, len);
-    token_lexeme[len] = '\0';
-    list->tokens[list->count++] = (Token){type, token_lexeme};
+    yoda_free(allocator, list->offsets);
+    *list = resized;
+    list->grow_events++;
+    return 1;
 }
 
-int is_keyword(const char* str) {
-    for (int i = 0; i < num_keywords; i++) {
-        if (strcmp(keywords[i], str) == 0) {
-            return 1;
+#ifndef YODA_NO_MAIN
+// An empty list with room for the tokens of a typical source of length
+// bytes (about one token per 4 bytes, up to 16M), so lexing rarely has to
+// grow it.
+#define TOKEN_LIST_MAX_PRESIZE (1 << 24)
+
+static TokenList new_token_list(const char* source, size_t length) {
+    TokenList list = {.source = source};
+    int capacity = length / 4 < TOKEN_LIST_MAX_PRESIZE ? (int)(length / 4) + 16 : TOKEN_LIST_MAX_PRESIZE;
+    if (!resize_tokens(&list, capacity, 0, 0, 0, NULL)) abort();
+    list.grow_events = 0;
+    return list;
+}
+
+static void add_token(TokenList* list, Token token, int partner, int symbol) {
+    if (list->count >= list->capacity && !resize_tokens(list, list->capacity * 2, 0, list->count, 0, NULL)) abort();
+    set_token(list, list->count++, token, partner, symbol);
+}
+#endif
+
+// Positions of brackets still waiting for their partner. Parens and braces
+// are matched independently, the same way the parser counts levels.
+typedef struct {
+    int* positions;
+    int count;
+    int capacity;
+} BracketStack;
+
+// Called for each token in order. Opening brackets are pushed; for a
+// closing bracket the position of its partner is popped and returned.
+// Returns -1 when there is nothing to pair, PAIR_OUT_OF_MEMORY if the
+// stack cannot grow.
+#define PAIR_OUT_OF_MEMORY -2
+
+static int pair_bracket(BracketStack* parens, BracketStack* braces, TokenType type, int pos, const YodaAllocator* allocator) {
+    BracketStack* stack;
+    if (type == TOKEN_LPAREN || type == TOKEN_RPAREN) stack = parens;
+    else if (type == TOKEN_LBRACE || type == TOKEN_RBRACE) stack = braces;
+    else return -1;
+    if (type == TOKEN_LPAREN || type == TOKEN_LBRACE) {
+        if (stack->count >= stack->capacity) {
+            int capacity = stack->capacity == 0 ? 16 : stack->capacity * 2;
+            int* positions = yoda_realloc(allocator, stack->positions, capacity * sizeof(int));
+            if (!positions) return PAIR_OUT_OF_MEMORY;
+            stack->positions = positions;
+            stack->capacity = capacity;
         }
+        stack->positions[stack->count++] = pos;
+        return -1;
     }
-    return 0;
+    return stack->count > 0 ? stack->positions[--stack->count] : -1;
+}
+
+// Start and length of a token's lexeme, for "%.*s" formatting.
+// The EOF token is an empty slice at the end of the source, spelled "EOF".
+static const char* lexeme_start(const TokenList* list, Token t) {
+    return t.type == TOKEN_EOF ? "EOF" : list->source + t.offset;
 }
+static int lexeme_length(Token t) { return t.type == TOKEN_EOF ? 3 : t.length; }
 
-TokenList tokenize(const char* source) {
-    TokenList token_list = {NULL, 0, 0};
-    const char* current = source;
+// Keyword recognition uses a perfect hash over keywords[], matched directly
+// against the source slice. The table is built on first use by searching for a
+// seed under which no two keywords collide, so adding a keyword only means
+// extending KEYWORDS.
+#define KEYWORD_TABLE_SIZE 64
+static int keyword_table[KEYWORD_TABLE_SIZE]; // index into keywords[] plus one, 0 if empty
+static unsigned int keyword_seed = 0;
+static int max_keyword_length = 0;
+static pthread_once_t keyword_table_once = PTHREAD_ONCE_INIT;
 
-    while (*current != '\0') {
-        if (isspace(*current)) {
-            current++;
-            continue;
+static unsigned int keyword_hash(const char* str, int len, unsigned int seed) {
+    unsigned int h = seed ^ (unsigned int)len;
+    for (int i = 0; i < len; i++) h = (h ^ (unsigned char)str[i]) * 16777619u;
+    return (h ^ (h >> 15)) & (KEYWORD_TABLE_SIZE - 1);
+}
+
+static void build_keyword_table(void) {
+    for (unsigned int seed = 2166136261u;; seed += 0x9E3779B9u) {
+        int collided = 0;
+        memset(keyword_table, 0, sizeof(keyword_table));
+        for (int i = 0; i < NUM_KEYWORDS && !collided; i++) {
+            int len = strlen(keywords[i]);
+            unsigned int slot = keyword_hash(keywords[i], len, seed);
+            if (keyword_table[slot]) collided = 1;
+            keyword_table[slot] = i + 1;
+            if (len > max_keyword_length) max_keyword_length = len;
         }
-        if (*current == '/' && *(current+1) == '/') { // Basic comment support
-            while (*current != '\n' && *current != '\0') current++;
+        if (!collided) { keyword_seed = seed; return; }
+    }
+}
+
+// Returns the keyword's ID, or -1 if str is not a keyword.
+static int keyword_id(const char* str, int len) {
+    if (len > max_keyword_length) return -1;
+    int entry = keyword_table[keyword_hash(str, len, keyword_seed)];
+    if (!entry) return -1;
+    const char* keyword = keywords[entry - 1];
+    return strncmp(keyword, str, len) == 0 && keyword[len] == '\0' ? entry - 1 : -1;
+}
+
+// Character classes that drive the tokenizer's dispatch, indexed by byte.
+// They match the "C" locale's isspace/isdigit/isalpha; bytes >= 0x80 are
+// CHAR_OTHER. CHAR_IDENT marks bytes that may continue an identifier.
+enum {
+    CHAR_OTHER,
+    CHAR_SPACE,
+    CHAR_DIGIT,
+    CHAR_ALPHA,
+    CHAR_PUNCT,    // ( ) { } ; ,
+    CHAR_OPERATOR, // > < = ! + - * % & |
+    CHAR_SLASH,
+    CHAR_HASH,
+    CHAR_QUOTE,
+    CHAR_IDENT = 0x10
+};
+
+#define __ CHAR_OTHER
+#define SP CHAR_SPACE
+#define DG (CHAR_DIGIT | CHAR_IDENT)
+#define AL (CHAR_ALPHA | CHAR_IDENT)
+#define PU CHAR_PUNCT
+#define OP CHAR_OPERATOR
+#define SL CHAR_SLASH
+#define HS CHAR_HASH
+#define QT CHAR_QUOTE
+static const unsigned char char_class[256] = {
+    /* 0x00 */ __, __, __, __, __, __, __, __, __, SP, SP, SP, SP, SP, __, __,
+    /* 0x10 */ __, __, __, __, __, __, __, __, __, __, __, __, __, __, __, __,
+    /* 0x20 */ SP, OP, QT, HS, __, OP, OP, __, PU, PU, OP, OP, PU, OP, __, SL,
+    /* 0x30 */ DG, DG, DG, DG, DG, DG, DG, DG, DG, DG, __, PU, OP, OP, OP, __,
+    /* 0x40 */ __, AL, AL, AL, AL, AL, AL, AL, AL, AL, AL, AL, AL, AL, AL, AL,
+    /* 0x50 */ AL, AL, AL, AL, AL, AL, AL, AL, AL, AL, AL, __, __, __, __, AL,
+    /* 0x60 */ __, AL, AL, AL, AL, AL, AL, AL, AL, AL, AL, AL, AL, AL, AL, AL,
+    /* 0x70 */ AL, AL, AL, AL, AL, AL, AL, AL, AL, AL, AL, PU, OP, PU, __, __,
+};
+#undef __
+#undef SP
+#undef DG
+#undef AL
+#undef PU
+#undef OP
+#undef SL
+#undef HS
+#undef QT
+
+#define CHAR_KIND(c) (char_class[(unsigned char)(c)] & 0x0F)
+
+// Run scanners: each returns the first position in [p, end) whose byte is
+// not part of the run. The vector loops only run while a whole vector fits
+// before end, so they never read past the source slice; the scalar loop
+// finishes the tail. AVX2 is used when the build enables it (-mavx2),
+// otherwise SSE2, which every x86-64 target has.
+enum { RUN_SPACE, RUN_DIGITS, RUN_IDENT };
+
+#if defined(__AVX2__)
+#define RUN_VECTOR_SIZE 32
+typedef __m256i RunVector;
+#define run_load(p) _mm256_loadu_si256((const __m256i*)(p))
+#define run_set1(c) _mm256_set1_epi8((char)(c))
+#define run_or(a, b) _mm256_or_si256(a, b)
+#define run_eq(a, b) _mm256_cmpeq_epi8(a, b)
+#define run_sub(a, b) _mm256_sub_epi8(a, b)
+#define run_min(a, b) _mm256_min_epu8(a, b)
+#define run_movemask(v) ((unsigned int)_mm256_movemask_epi8(v))
+#define RUN_FULL_MASK 0xFFFFFFFFu
+#elif defined(__SSE2__)
+#define RUN_VECTOR_SIZE 16
+typedef __m128i RunVector;
+#define run_load(p) _mm_loadu_si128((const __m128i*)(p))
+#define run_set1(c) _mm_set1_epi8((char)(c))
+#define run_or(a, b) _mm_or_si128(a, b)
+#define run_eq(a, b) _mm_cmpeq_epi8(a, b)
+#define run_sub(a, b) _mm_sub_epi8(a, b)
+#define run_min(a, b) _mm_min_epu8(a, b)
+#define run_movemask(v) ((unsigned int)_mm_movemask_epi8(v))
+#define RUN_FULL_MASK 0xFFFFu
+#endif
+
+#ifdef RUN_VECTOR_SIZE
+// Lanes holding lo <= byte <= hi (unsigned).
+static RunVector run_in_range(RunVector v, unsigned char lo, unsigned char hi) {
+    RunVector d = run_sub(v, run_set1(lo));
+    return run_eq(run_min(d, run_set1(hi - lo)), d);
+}
+
+static unsigned int run_mask(RunVector v, int run) {
+    RunVector digits = run_in_range(v, '0', '9');
+    if (run == RUN_SPACE) return run_movemask(run_or(run_in_range(v, '\t', '\r'), run_eq(v, run_set1(' '))));
+    if (run == RUN_DIGITS) return run_movemask(digits);
+    RunVector letters = run_in_range(run_or(v, run_set1(0x20)), 'a', 'z');
+    return run_movemask(run_or(run_or(letters, digits), run_eq(v, run_set1('_'))));
+}
+#endif
+
+static int run_continues(unsigned char c, int run) {
+    if (run == RUN_SPACE) return char_class[c] == CHAR_SPACE;
+    if (run == RUN_DIGITS) return (char_class[c] & 0x0F) == CHAR_DIGIT;
+    return (char_class[c] & CHAR_IDENT) != 0;
+}
+
+static const char* scan_run(const char* p, const char* end, int run) {
+#ifdef RUN_VECTOR_SIZE
+    while (end - p >= RUN_VECTOR_SIZE) {
+        unsigned int mask = run_mask(run_load(p), run);
+        if (mask != RUN_FULL_MASK) return p + __builtin_ctz(~mask);
+        p += RUN_VECTOR_SIZE;
+    }
+#endif
+    while (p < end && run_continues((unsigned char)*p, run)) p++;
+    return p;
+}
+
+// Finds the end of a line: the next '\n' or end.
+static const char* scan_line(const char* p, const char* end) {
+    const char* newline = memchr(p, '\n', end - p);
+    return newline ? newline : end;
+}
+
+// Lexer state for pulling tokens one at a time. The source is a
+// (pointer, length) slice and need not be NUL-terminated, so a
+// memory-mapped file can be lexed in place.
+typedef struct {
+    const char* source;
+    const char* current;
+    const char* end;
+    const YodaDiagnostics* diagnostics; // stdout if NULL
+} Lexer;
+
+static void init_lexer(Lexer* lexer, const char* source, size_t length) {
+    lexer->source = source;
+    lexer->current = source;
+    lexer->end = source + length;
+    lexer->diagnostics = NULL;
+    pthread_once(&keyword_table_once, build_keyword_table);
+}
+
+static Token lexer_token(Lexer* lexer, TokenType type, const char* start, const char* stop) {
+    lexer->current = stop;
+    return (Token){type, -1, (int)(stop - start), start - lexer->source};
+}
+
+// Returns the next token, or TOKEN_EOF (repeatedly) once the source is exhausted.
+static Token next_token(Lexer* lexer) {
+    const char* current = lexer->current;
+    const char* end = lexer->end;
+
+    while (current < end) {
+        const char* start = current;
+        switch (CHAR_KIND(*current)) {
+        case CHAR_SPACE:
+            current = scan_run(current + 1, end, RUN_SPACE);
             continue;
+
+        case CHAR_DIGIT:
+            current = scan_run(current + 1, end, RUN_DIGITS);
+            return lexer_token(lexer, TOKEN_NUMBER, start, current);
+
+        case CHAR_ALPHA: {
+            current = scan_run(current + 1, end, RUN_IDENT);
+            int keyword = keyword_id(start, current - start);
+            Token token = lexer_token(lexer, keyword >= 0 ? TOKEN_KEYWORD : TOKEN_IDENTIFIER, start, current);
+            token.keyword = keyword;
+            return token;
         }
-        
-        if (*current == '#') {
-            const char* start = current;
-            while (*current != '\n' && *current != '\0') current++;
-            add_token(&token_list, TOKEN_PREPROCESSOR, start, current - start);
-            continue;
+
+        case CHAR_PUNCT: {
+            TokenType type = TOKEN_UNKNOWN;
+            switch (*current) {
+            case '(': type = TOKEN_LPAREN; break;
+            case ')': type = TOKEN_RPAREN; break;
+            case '{': type = TOKEN_LBRACE; break;
+            case '}': type = TOKEN_RBRACE; break;
+            case ';': type = TOKEN_SEMICOLON; break;
+            case ',': type = TOKEN_COMMA; break;
+            }
+            return lexer_token(lexer, type, start, current + 1);
         }
 
-        // Handle operators: ==, !=, >=, <=, >, <
-        // This block must come BEFORE the single-character checks to correctly handle multi-character tokens.
-        if (strchr("><=!", *current)) {
-            const char* start = current;
-            // Check for two-character operators first
-            if ((*start == '>' || *start == '<' || *start == '!' || *start == '=') && *(start + 1) == '=') {
-                add_token(&token_list, TOKEN_IDENTIFIER, start, 2);
-                current += 2;
-                continue;
+        // Handle operators: ==, !=, >=, <=, >, <, !, &&, ||, + - * %
+        // A single '=' is an assignment. A single '&' or '|' is an error.
+        case CHAR_OPERATOR: {
+            char c = *current;
+            char next = current + 1 < end ? *(current + 1) : '\0';
+            if (next == '=' && (c == '=' || c == '!' || c == '<' || c == '>')) {
+                return lexer_token(lexer, TOKEN_OPERATOR, start, current + 2);
             }
-            // Check for single-character operators
-            if (*start == '>' || *start == '<') {
-                add_token(&token_list, TOKEN_IDENTIFIER, start, 1);
-                current++;
-                continue;
+            if (c == '=') {
+                return lexer_token(lexer, TOKEN_EQUALS, start, current + 1);
             }
-            // A single '=' is handled later as an assignment. A single '!' is an error.
-        }
-
-        if (*current == '(') { add_token(&token_list, TOKEN_LPAREN, current++, 1); continue; }
-        if (*current == ')') { add_token(&token_list, TOKEN_RPAREN, current++, 1); continue; }
-        if (*current == '{') { add_token(&token_list, TOKEN_LBRACE, current++, 1); continue; }
-        if (*current == '}') { add_token(&token_list, TOKEN_RBRACE, current++, 1); continue; }
-        if (*current == '=') { add_token(&token_list, TOKEN_EQUALS, current++, 1); continue; }
-        if (*current == ';') { add_token(&token_list, TOKEN_SEMICOLON, current++, 1); continue; }
-        if (*current == ',') { add_token(&token_list, TOKEN_COMMA, current++, 1); continue; }
-        
-        if (isdigit(*current)) {
-            const char* start = current;
-            while (isdigit(*current)) current++;
-            add_token(&token_list, TOKEN_NUMBER, start, current - start);
-            continue;
+            if (c == '&' || c == '|') {
+                if (next != c) break;
+                return lexer_token(lexer, TOKEN_OPERATOR, start, current + 2);
+            }
+            return lexer_token(lexer, TOKEN_OPERATOR, start, current + 1);
         }
 
-        if (isalpha(*current) || *current == '_') {
-            const char* start = current;
-            while (isalnum(*current) || *current == '_') current++;
-            int len = current - start;
-            char* temp = malloc(len + 1);
-            if (temp == NULL) { fprintf(stderr, "Memory allocation failed.\n"); exit(1); }
-            strncpy(temp, start, len);
-            temp[len] = '\0';
-            if (is_keyword(temp)) {
-                add_token(&token_list, TOKEN_KEYWORD, start, len);
-            } else {
-                add_token(&token_list, TOKEN_IDENTIFIER, start, len);
+        case CHAR_SLASH: // Basic comment support; otherwise division
+            if (current + 1 < end && *(current + 1) == '/') {
+                current = scan_line(current, end);
+                continue;
             }
-            free(temp);
-            continue;
-        }
-        
+            return lexer_token(lexer, TOKEN_OPERATOR, start, current + 1);
+
+        case CHAR_HASH:
+            return lexer_token(lexer, TOKEN_PREPROCESSOR, start, scan_line(current, end));
+
         // Correctly parse string literals
-        if (*current == '"') {
-            const char* start = current;
+        case CHAR_QUOTE:
             current++; // Move past the opening quote
-            while(*current != '"' && *current != '\0') {
-                 if (*current == '\\' && *(current+1) != '\0') current++; // Skip escaped char
+            while(current < end && *current != '"') {
+                 if (*current == '\\' && current + 1 < end) current++; // Skip escaped char
                  current++;
             }
-            if (*current == '"') current++; // Move past the closing quote
-            add_token(&token_list, TOKEN_IDENTIFIER, start, current - start);
-            continue;
+            if (current < end) current++; // Move past the closing quote
+            return lexer_token(lexer, TOKEN_IDENTIFIER, start, current);
         }
 
-        printf("Tokenizer Error: Unknown character '%c'\n", *current);
-        add_token(&token_list, TOKEN_UNKNOWN, current++, 1);
+        report_diagnostic(lexer->diagnostics, "Tokenizer Error: Unknown character '%c'", *current);
+        return lexer_token(lexer, TOKEN_UNKNOWN, start, current + 1);
+    }
+
+    return lexer_token(lexer, TOKEN_EOF, current, current);
+}
+
+// Identifiers are interned to integer IDs as they are lexed, so the parser
+// compares and looks up names as integers. Keywords are IDs 0 to
+// NUM_KEYWORDS - 1; identifiers get the IDs after them in order of
+// appearance. The table only remembers the names of the top-level
+// declaration being lexed: the '}' that ends one empties it by bumping the
+// generation, so its memory is bounded by the largest declaration, not by
+// the input. A name that comes back in a later declaration gets a new ID.
+// IDs are never reused, so two names never share one; as there are fewer
+// than INT_MAX tokens, neither they nor the generations run out.
+typedef struct {
+    size_t offset;           // first occurrence in the source
+    int length;
+    int id;
+    unsigned int hash;
+    unsigned int generation; // the slot is empty unless it is the table's
+} SymbolSlot;
+
+typedef struct {
+    SymbolSlot* slots;
+    int capacity;            // a power of two, or 0
+    int count;               // names of the current generation
+    unsigned int generation; // 0 until the first name, and for unused slots
+    int next_id;             // counted from NUM_KEYWORDS
+    int depth;               // '{' nesting where the lexer is
+} SymbolTable;
+
+#define SYMBOL_OUT_OF_MEMORY -2
+
+static int intern_symbol(SymbolTable* table, const char* source, Token token, const YodaAllocator* allocator) {
+    if ((table->count + 1) * 2 > table->capacity) {
+        int capacity = table->capacity == 0 ? 256 : table->capacity * 2;
+        SymbolSlot* slots = yoda_realloc(allocator, NULL, capacity * sizeof(SymbolSlot));
+        if (!slots) return SYMBOL_OUT_OF_MEMORY;
+        memset(slots, 0, capacity * sizeof(SymbolSlot));
+        if (table->generation == 0) table->generation = 1;
+        for (int i = 0; i < table->capacity; i++) {
+            if (table->slots[i].generation != table->generation) continue;
+            unsigned int slot = table->slots[i].hash & (capacity - 1);
+            while (slots[slot].generation == table->generation) slot = (slot + 1) & (capacity - 1);
+            slots[slot] = table->slots[i];
+        }
+        yoda_free(allocator, table->slots);
+        table->slots = slots;
+        table->capacity = capacity;
+    }
+    const char* name = source + token.offset;
+    unsigned int hash = 2166136261u, mask = table->capacity - 1;
+    for (int i = 0; i < token.length; i++) hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    unsigned int slot = hash & mask;
+    for (; table->slots[slot].generation == table->generation; slot = (slot + 1) & mask) {
+        const SymbolSlot* symbol = &table->slots[slot];
+        if (symbol->hash == hash && symbol->length == token.length &&
+            memcmp(source + symbol->offset, name, token.length) == 0) {
+            return symbol->id;
+        }
+    }
+    table->slots[slot] = (SymbolSlot){token.offset, token.length, NUM_KEYWORDS + table->next_id++, hash, table->generation};
+    table->count++;
+    return table->slots[slot].id;
+}
+
+// Called on every token in order. Returns its ID (interning identifiers;
+// string literals are not names), -1 for tokens that are not names, or
+// SYMBOL_OUT_OF_MEMORY.
+static int token_symbol(SymbolTable* table, const char* source, Token token, const YodaAllocator* allocator) {
+    switch (token.type) {
+    case TOKEN_KEYWORD:
+        return token.keyword;
+    case TOKEN_IDENTIFIER:
+        return source[token.offset] == '"' ? -1 : intern_symbol(table, source, token, allocator);
+    case TOKEN_LBRACE:
+        table->depth++;
+        return -1;
+    case TOKEN_RBRACE:
+        if (table->depth > 0 && --table->depth == 0) {
+            table->count = 0;
+            table->generation++;
+        }
+        return -1;
+    default:
+        return -1;
     }
-    
-    add_token(&token_list, TOKEN_EOF, "EOF", 3);
-    return token_list;
 }
 
-void free_tokens(TokenList* list) {
-    for (int i = 0; i < list->count; i++) {
-        free(list->tokens[i].lexeme);
+#ifndef YODA_NO_MAIN
+// Lexes the whole source into a TokenList ending with TOKEN_EOF, pairing
+// brackets and interning names in the same pass.
+static TokenList tokenize(const char* source, size_t length) {
+    TokenList token_list = new_token_list(source, length);
+    BracketStack parens = {NULL, 0, 0}, braces = {NULL, 0, 0};
+    SymbolTable symbols = {NULL, 0, 0, 0, 0, 0};
+    Lexer lexer;
+    init_lexer(&lexer, source, length);
+    for (;;) {
+        Token token = next_token(&lexer);
+        int open = pair_bracket(&parens, &braces, token.type, token_list.count, NULL);
+        if (open >= 0) token_list.partners[open] = token_list.count;
+        int symbol = token_symbol(&symbols, source, token, NULL);
+        if (symbol == SYMBOL_OUT_OF_MEMORY) abort();
+        add_token(&token_list, token, open >= 0 ? open : -1, symbol);
+        if (token.type == TOKEN_EOF) break;
     }
-    free(list->tokens);
+    free(parens.positions);
+    free(braces.positions);
+    free(symbols.slots);
+    return token_list;
+}
+
+static void free_tokens(TokenList* list) {
+    free(list->offsets);
 }
+#endif
 
 // --- Parser Section ---
 
+// Syntax tree of one top-level declaration. The parser builds it and a
+// separate pass emits C from it. Nodes live contiguously in one array and
+// refer to each other by index, so a tree is discarded (and its memory
+// reused for the next declaration) all at once. Names and lexemes are
+// source slices, which stay valid after the streaming parser has dropped
+// their tokens.
+//
+// Conditions, arguments and statements are expression trees when their
+// tokens form an expression; anything else (a C declaration, a for header
+// that is not three clauses, ...) is kept as a NODE_EXPRESSION token list
+// and emitted as it always was.
+typedef enum {
+    NODE_PREPROCESSOR, // text: the directive line
+    NODE_FUNCTION,     // text: name, type: return type; children: NODE_PARAM..., NODE_BLOCK
+    NODE_PARAM,        // text: name, type: its type
+    NODE_BLOCK,        // children: statements
+    NODE_DECL,         // text: name, type: its type; child: value
+    NODE_CALL,         // text: function name; children: arguments (or one token list)
+    NODE_IF,           // children: condition, NODE_BLOCK, optional else NODE_BLOCK
+    NODE_WHILE,        // children: condition, NODE_BLOCK
+    NODE_FOR,          // children: NODE_FOR_HEADER or token list, NODE_BLOCK
+    NODE_FOR_HEADER,   // children: three clauses, each an expression or NODE_EMPTY
+    NODE_RETURN,       // child: optional value
+    NODE_STATEMENT,    // child: expression or token list, the tokens before ';'
+    NODE_EXPRESSION,   // token list; children: NODE_TOKEN in source order
+    NODE_TOKEN,        // text: the lexeme
+    NODE_EMPTY,
+    // Expressions
+    NODE_NUMBER,       // text: the literal
+    NODE_NAME,         // text: identifier or string literal
+    NODE_UNARY,        // text: operator; child: operand
+    NODE_BINARY,       // text: operator; children: left, right
+    NODE_ASSIGN,       // text: "="; children: NODE_NAME, value
+    NODE_GROUP,        // child: the parenthesized expression
+    NODE_CONSTANT      // value: a folded constant expression
+} NodeKind;
+
+typedef struct {
+    size_t offset;
+    int length;
+} Slice;
+
+typedef struct {
+    NodeKind kind;
+    int symbol;        // ID of text if it is a name, else -1
+    Slice text;
+    Slice type;
+    int first_child;   // -1 if none
+    int next_sibling;  // -1 if last
+    int value;         // NODE_CONSTANT only
+} AstNode;
+
+typedef struct {
+    AstNode* nodes;
+    int count;
+    int capacity;
+} Ast;
+
+static Slice token_slice(Token t) { return (Slice){t.offset, t.length}; }
+
+// Integer macros from "#define NAME <integer>" lines, as the preprocessor
+// will see them at the point the parser has reached, and the functions the
+// program has declared by then. Open addressing keyed by name; entries are
+// never removed, only marked unknown.
+typedef struct {
+    const char* name; // NULL if the slot is empty
+    int length;
+    int value;
+    int known;
+    int function;     // declared as a function of the program
+} Macro;
+
+typedef struct {
+    Macro* slots;
+    int capacity;          // a power of two, or 0
+    int count;
+    int conditional_depth; // #if nesting at this point
+} MacroTable;
+
+// What the parser knows about the names of the declaration being parsed,
+// keyed by symbol ID. Whether a name is a macro or a function is looked up
+// by name once, when its ID is first seen. A slot belongs to the
+// declaration only while its generation is the current one, so moving on
+// to the next declaration just bumps the generation.
+typedef struct {
+    int symbol;
+    unsigned int generation; // 0 marks a slot that was never used
+    int declared;            // a parameter or variable of the declaration
+    int known;               // an integer macro, whose value is value
+    int value;
+    int function;            // a function the program has declared
+    int vm_function;         // its index in the VM program, -1 until looked up
+} NameInfo;
+
+typedef struct {
+    NameInfo* slots;
+    int capacity;            // a power of two, or 0
+    int count;               // names of the current generation
+    unsigned int generation;
+} NameTable;
+
+// The parser reads tokens either from a fully tokenized TokenList or, when
+// lexer is set, pulls them on demand into a ring buffer held in tokens
+// (capacity is a power of two, count is unused). The ring keeps the window
+// [window_start, window_end) of absolute token positions; consumed tokens
+// are dropped when it fills, so memory is bounded by the longest lookahead
+// (one parenthesized group) rather than by the file.
 typedef struct {
     TokenList tokens;
+    Lexer* lexer;
+    int window_start;
+    int window_end;
+    BracketStack open_parens;
+    BracketStack open_braces;
+    SymbolTable symbol_table;
     int current_token_pos;
+    const YodaDiagnostics* diagnostics; // where parse errors go; stdout if NULL
+    const YodaAllocator* allocator;     // libc if NULL
+    const YodaSink* sink;   // if set, completed declarations are flushed here
+    int out_of_memory;
+    int too_many_tokens;     // the stream outgrew int token positions
+    int pinned;              // while set, tokens from pin_pos on stay buffered
+    int pin_pos;
+    Ast ast;                 // the declaration being parsed
+    NameTable names;         // its names, by symbol ID
+    MacroTable* macros;      // #defines in effect; parse_program keeps its own if NULL
+    struct VmProgram* vm;    // if set, declarations are compiled to bytecode instead of C
     char* output;
     int output_capacity;
     int output_size;
+    long append_calls;       // for --stats
+    int output_grow_events;
 } Parser;
 
+// Collects the children of parent in order while they are parsed.
+typedef struct {
+    int parent;
+    int last;
+} Children;
+
 // Forward declarations
-int parse_statement(Parser* p);
-int parse_for_loop(Parser* p);
-int parse_while_loop(Parser* p);
-int parse_if_statement(Parser* p);
-int parse_variable_declaration(Parser* p);
-int parse_function_declaration(Parser* p);
-int parse_reversed_function_call(Parser* p);
-
-void append_output(Parser* p, const char* str) {
-    int len = strlen(str);
-    while (p->output_size + len + 1 > p->output_capacity) {
-        p->output_capacity = p->output_capacity == 0 ? 256 : p->output_capacity * 2;
-        p->output = realloc(p->output, p->output_capacity);
-    }
-    strcat(p->output, str);
+static int parse_statement(Parser* p, Children* block);
+static int parse_for_loop(Parser* p, Children* block);
+static int parse_while_loop(Parser* p, Children* block);
+static int parse_if_statement(Parser* p, Children* block);
+static int parse_variable_declaration(Parser* p, Children* block);
+static int parse_function_declaration(Parser* p);
+static int parse_reversed_function_call(Parser* p, Children* block);
+static int compile_declaration(Parser* p);
+static int lookup_macro(const MacroTable* table, const char* name, int length, int* value);
+static int is_function(const MacroTable* table, const char* name, int length);
+static int declare_function(MacroTable* table, const YodaAllocator* allocator, const char* name, int length);
+
+// The output is built by appending at a tracked write cursor (output_size),
+// so every append costs time proportional to the appended text only.
+static void append_output_n(Parser* p, const char* str, int len) {
+    p->append_calls++;
+    if (p->output_size + len + 1 > p->output_capacity) {
+        int capacity = p->output_capacity == 0 ? 256 : p->output_capacity;
+        while (p->output_size + len + 1 > capacity) capacity *= 2;
+        char* output = yoda_realloc(p->allocator, p->output, capacity);
+        if (!output) { p->out_of_memory = 1; return; }
+        p->output = output;
+        p->output_capacity = capacity;
+        p->output_grow_events++;
+    }
+    memcpy(p->output + p->output_size, str, len);
     p->output_size += len;
+    p->output[p->output_size] = '\0';
+}
+
+static void append_output(Parser* p, const char* str) { append_output_n(p, str, strlen(str)); }
+
+#define TOKEN_RING_INITIAL_CAPACITY 256
+
+static int grow_token_ring(Parser* p) {
+    int capacity = p->tokens.capacity == 0 ? TOKEN_RING_INITIAL_CAPACITY : p->tokens.capacity * 2;
+    return resize_tokens(&p->tokens, capacity, p->window_start, p->window_end, 1, p->allocator);
+}
+
+// Pulls tokens from the lexer until absolute position pos is buffered or
+// EOF has been pulled. Running out of memory ends the stream early.
+static void fill_token_ring(Parser* p, int pos) {
+    while (p->window_end <= pos && !p->out_of_memory) {
+        if (p->window_end > p->window_start &&
+            p->tokens.types[(p->window_end - 1) & (p->tokens.capacity - 1)] == TOKEN_EOF) return;
+        if (p->window_end - p->window_start == p->tokens.capacity) {
+            int keep = p->pinned && p->pin_pos < p->current_token_pos ? p->pin_pos : p->current_token_pos;
+            if (p->window_start < keep) p->window_start = keep;
+            else if (!grow_token_ring(p)) { p->out_of_memory = 1; return; }
+        }
+        int mask = p->tokens.capacity - 1;
+        Token token = next_token(p->lexer);
+        if (p->window_end == INT_MAX - 1 && token.type != TOKEN_EOF) {
+            // Byte offsets are 64-bit, but token positions are ints.
+            report_diagnostic(p->diagnostics, "Tokenizer Error: the input has more than %d tokens.", INT_MAX - 2);
+            p->too_many_tokens = 1;
+            token = (Token){TOKEN_EOF, -1, 0, token.offset};
+        }
+        int symbol = token_symbol(&p->symbol_table, p->tokens.source, token, p->allocator);
+        if (symbol == SYMBOL_OUT_OF_MEMORY) { p->out_of_memory = 1; return; }
+        int open = pair_bracket(&p->open_parens, &p->open_braces, token.type, p->window_end, p->allocator);
+        if (open == PAIR_OUT_OF_MEMORY) { p->out_of_memory = 1; return; }
+        if (open >= 0 && open >= p->window_start) p->tokens.partners[open & mask] = p->window_end;
+        set_token(&p->tokens, p->window_end & mask, token, open >= 0 ? open : -1, symbol);
+        p->window_end++;
+    }
+}
+
+// Index in tokens of absolute position pos (the last token if pos is past
+// it), or -1 if memory ran out while buffering it.
+static int token_index(Parser* p, int pos) {
+    if (p->lexer) {
+        fill_token_ring(p, pos);
+        if (p->out_of_memory) return -1;
+        if (pos >= p->window_end) pos = p->window_end - 1;
+        return pos & (p->tokens.capacity - 1);
+    }
+    if (pos >= p->tokens.count) pos = p->tokens.count - 1;
+    return pos;
+}
+
+static Token token_at(Parser* p, int pos) {
+    int index = token_index(p, pos);
+    if (index < 0) return (Token){TOKEN_EOF, -1, 0, p->lexer->end - p->lexer->source};
+    return get_token(&p->tokens, index);
+}
+
+// Just the type, read from the types array alone.
+static TokenType token_type_at(Parser* p, int pos) {
+    int index = token_index(p, pos);
+    return index < 0 ? TOKEN_EOF : p->tokens.types[index];
 }
 
-Token current_token(Parser* p) { return p->tokens.tokens[p->current_token_pos]; }
-Token peek_at(Parser* p, int offset) {
-    if (p->current_token_pos + offset >= p->tokens.count) return p->tokens.tokens[p->tokens.count - 1];
-    return p->tokens.tokens[p->current_token_pos + offset];
+// The symbol ID of the current token, or -1.
+static int current_symbol(Parser* p) {
+    int index = token_index(p, p->current_token_pos);
+    return index < 0 ? -1 : p->tokens.symbols[index];
 }
-Token advance(Parser* p) {
-    if (p->current_token_pos < p->tokens.count - 1) p->current_token_pos++;
-    return p->tokens.tokens[p->current_token_pos - 1];
+
+static Token current_token(Parser* p) { return token_at(p, p->current_token_pos); }
+static Token peek_at(Parser* p, int offset) { return token_at(p, p->current_token_pos + offset); }
+static Token advance(Parser* p) {
+    Token t = current_token(p);
+    if (t.type != TOKEN_EOF) p->current_token_pos++;
+    return t;
 }
-int match(Parser* p, TokenType type) { return current_token(p).type == type; }
-int consume(Parser* p, TokenType type, const char* error_message) {
+static int match(Parser* p, TokenType type) { return token_type_at(p, p->current_token_pos) == type; }
+static int consume(Parser* p, TokenType type, const char* error_message) {
     if (match(p, type)) {
         advance(p);
         return 1;
     }
-    printf("Parser Error: %s. Got '%s' instead.\n", error_message, current_token(p).lexeme);
+    Token t = current_token(p);
+    report_diagnostic(p->diagnostics, "Parser Error: %s. Got '%.*s' instead.", error_message, lexeme_length(t), lexeme_start(&p->tokens, t));
     return 0;
 }
 
-void slurp_tokens_until(Parser *p, TokenType end_type, char* buffer, int buffer_size) {
-    buffer[0] = '\0';
+// Appends a node and returns its index, or -1 when out of memory (the
+// parse then runs to its end without building anything further).
+static int add_node(Parser* p, NodeKind kind, Slice text, Slice type) {
+    Ast* ast = &p->ast;
+    if (ast->count == ast->capacity) {
+        int capacity = ast->capacity == 0 ? 64 : ast->capacity * 2;
+        AstNode* nodes = yoda_realloc(p->allocator, ast->nodes, capacity * sizeof(AstNode));
+        if (!nodes) { p->out_of_memory = 1; return -1; }
+        ast->nodes = nodes;
+        ast->capacity = capacity;
+    }
+    ast->nodes[ast->count] = (AstNode){kind, -1, text, type, -1, -1, 0};
+    return ast->count++;
+}
+
+// Sets the symbol ID of node, unless it is -1 (out of memory), and returns it.
+static int with_symbol(Parser* p, int node, int symbol) {
+    if (node >= 0) p->ast.nodes[node].symbol = symbol;
+    return node;
+}
+
+static void add_child(Parser* p, Children* children, int child) {
+    if (children->parent < 0 || child < 0) return;
+    if (children->last < 0) p->ast.nodes[children->parent].first_child = child;
+    else p->ast.nodes[children->last].next_sibling = child;
+    children->last = child;
+}
+
+// Adds a node as the next child in children and returns the list for its
+// own children.
+static Children add_node_to(Parser* p, Children* children, NodeKind kind, Slice text, Slice type) {
+    int node = add_node(p, kind, text, type);
+    add_child(p, children, node);
+    return (Children){node, -1};
+}
+
+// Collects the tokens up to (not including) end_type into a token list.
+static void parse_tokens_until(Parser* p, Children* parent, TokenType end_type) {
+    Children expression = add_node_to(p, parent, NODE_EXPRESSION, (Slice){0, 0}, (Slice){0, 0});
     while (!match(p, end_type) && !match(p, TOKEN_EOF)) {
-        if (strlen(buffer) > 0) strncat(buffer, " ", buffer_size - strlen(buffer) - 1);
-        strncat(buffer, current_token(p).lexeme, buffer_size - strlen(buffer) - 1);
-        advance(p);
+        add_node_to(p, &expression, NODE_TOKEN, token_slice(advance(p)), (Slice){0, 0});
     }
 }
 
-// Helper to find the offset after a matching parenthesis block
-int get_offset_after_paren(Parser* p) {
+// Helper to find the offset after a matching parenthesis block, read off
+// the bracket index. When streaming, this pulls tokens only as far as the
+// matching ')'. An unmatched '(' runs to EOF.
+static int get_offset_after_paren(Parser* p) {
     if (!match(p, TOKEN_LPAREN)) return 0;
-    int paren_level = 1;
     int offset = 1;
-    while(paren_level > 0 && (p->current_token_pos + offset) < p->tokens.count) {
-        Token t = peek_at(p, offset);
-        if (t.type == TOKEN_LPAREN) paren_level++;
-        if (t.type == TOKEN_RPAREN) paren_level--;
-        offset++;
+    for (;;) {
+        int index = token_index(p, p->current_token_pos);
+        if (index >= 0 && p->tokens.partners[index] >= 0) return p->tokens.partners[index] - p->current_token_pos + 1;
+        if (token_type_at(p, p->current_token_pos + offset) == TOKEN_EOF) return offset + 1;
+        if (p->lexer) offset = p->window_end - p->current_token_pos;
+        else offset = p->tokens.count - p->current_token_pos - 1;
     }
-    return offset;
 }
 
-int parse_reversed_function_call(Parser* p) {
-    char args_buffer[1024] = {0};
-    if (!consume(p, TOKEN_LPAREN, "Expected '(' for function call")) return 0;
-    
-    int start_token_pos = p->current_token_pos;
-    int paren_level = 1;
-    while(paren_level > 0 && !match(p, TOKEN_EOF)) {
-        if (match(p, TOKEN_LPAREN)) paren_level++;
-        if (match(p, TOKEN_RPAREN)) paren_level--;
-        if (paren_level > 0) advance(p);
+// --- Expressions ---
+
+// Precedence climbing over C's binary operators. Every function returns
+// the index of the node it built, or -1 if the tokens are not an
+// expression (or memory ran out); callers then fall back to a token list.
+enum {
+    PREC_NONE,
+    PREC_ASSIGN,     // = (right associative)
+    PREC_OR,         // ||
+    PREC_AND,        // &&
+    PREC_EQUALITY,   // == !=
+    PREC_COMPARISON, // < > <= >=
+    PREC_TERM,       // + -
+    PREC_FACTOR      // * / %
+};
+
+static int binary_precedence(Parser* p, Token t) {
+    if (t.type == TOKEN_EQUALS) return PREC_ASSIGN;
+    if (t.type != TOKEN_OPERATOR) return PREC_NONE;
+    switch (p->tokens.source[t.offset]) {
+    case '|': return PREC_OR;
+    case '&': return PREC_AND;
+    case '=': return PREC_EQUALITY;
+    case '!': return t.length == 2 ? PREC_EQUALITY : PREC_NONE;
+    case '<': case '>': return PREC_COMPARISON;
+    case '+': case '-': return PREC_TERM;
+    case '*': case '/': case '%': return PREC_FACTOR;
+    }
+    return PREC_NONE;
+}
+
+static int is_prefix_operator(Parser* p, Token t) {
+    if (t.type != TOKEN_OPERATOR || t.length != 1) return 0;
+    char c = p->tokens.source[t.offset];
+    return c == '-' || c == '+' || c == '!';
+}
+
+// Builds a node whose children are first and, if >= 0, second.
+static int add_parent(Parser* p, NodeKind kind, Slice text, int first, int second) {
+    int node = add_node(p, kind, text, (Slice){0, 0});
+    if (node < 0) return -1;
+    p->ast.nodes[node].first_child = first;
+    p->ast.nodes[first].next_sibling = second;
+    return node;
+}
+
+static int parse_expression(Parser* p, int min_precedence);
+
+// Parses "expr, expr, ..." up to the ')' at close_pos as the arguments of
+// call. Returns 0 if they are not expressions.
+static int parse_arguments(Parser* p, Children* call, int close_pos) {
+    while (p->current_token_pos < close_pos) {
+        int argument = parse_expression(p, PREC_ASSIGN);
+        if (argument < 0) return 0;
+        add_child(p, call, argument);
+        if (p->current_token_pos == close_pos) break;
+        if (!match(p, TOKEN_COMMA)) return 0;
+        advance(p);
+        if (p->current_token_pos == close_pos) return 0; // trailing comma
+    }
+    return p->current_token_pos == close_pos && match(p, TOKEN_RPAREN);
+}
+
+// The entry for symbol in the declaration being parsed, added on first
+// sight with what the macro table says about name. NULL for -1 (a string
+// literal), or if memory runs out.
+static NameInfo* name_info(Parser* p, int symbol, Slice name) {
+    if (symbol < 0) return NULL;
+    NameTable* table = &p->names;
+    if ((table->count + 1) * 2 > table->capacity) {
+        int capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+        NameInfo* slots = yoda_realloc(p->allocator, NULL, capacity * sizeof(NameInfo));
+        if (!slots) { p->out_of_memory = 1; return NULL; }
+        memset(slots, 0, capacity * sizeof(NameInfo));
+        for (int i = 0; i < table->capacity; i++) {
+            if (table->slots[i].generation != table->generation) continue;
+            unsigned int slot = (unsigned int)table->slots[i].symbol & (capacity - 1);
+            while (slots[slot].generation == table->generation) slot = (slot + 1) & (capacity - 1);
+            slots[slot] = table->slots[i];
+        }
+        yoda_free(p->allocator, table->slots);
+        table->slots = slots;
+        table->capacity = capacity;
+    }
+    // IDs are handed out in order, so within a declaration they rarely collide.
+    unsigned int mask = table->capacity - 1, slot = (unsigned int)symbol & mask;
+    for (; table->slots[slot].generation == table->generation; slot = (slot + 1) & mask) {
+        if (table->slots[slot].symbol == symbol) return &table->slots[slot];
+    }
+    NameInfo* info = &table->slots[slot];
+    const char* text = p->tokens.source + name.offset;
+    *info = (NameInfo){symbol, table->generation, 0, 0, 0, 0, -1};
+    info->known = lookup_macro(p->macros, text, name.length, &info->value);
+    info->function = is_function(p->macros, text, name.length);
+    table->count++;
+    return info;
+}
+
+// Whether node names a parameter or variable of the declaration being parsed.
+static int is_declared_variable(Parser* p, const AstNode* node) {
+    const NameInfo* info = name_info(p, node->symbol, node->text);
+    return info && info->declared;
+}
+
+static void declare_variable(Parser* p, int symbol, Slice name) {
+    NameInfo* info = name_info(p, symbol, name);
+    if (info) info->declared = 1;
+}
+
+// Whether node names an integer macro, and its value.
+static int is_known_macro(Parser* p, const AstNode* node, int* value) {
+    const NameInfo* info = name_info(p, node->symbol, node->text);
+    if (!info || !info->known) return 0;
+    *value = info->value;
+    return 1;
+}
+
+// Whether "(group)name" is a Yoda call rather than a C cast "(type)name".
+// It is when name is a function the program has declared, or when group
+// cannot be a type: it is empty, several expressions, or anything but a
+// lone identifier that is not a variable of this declaration or an integer
+// macro. When unsure, it is left to C as written.
+static int is_call(Parser* p, const AstNode* group, int symbol, Slice name) {
+    const NameInfo* callee = name_info(p, symbol, name);
+    if ((callee && callee->function) || group->first_child < 0) return 1;
+    const AstNode* only = &p->ast.nodes[group->first_child];
+    if (only->next_sibling >= 0 || only->kind != NODE_NAME || p->tokens.source[only->text.offset] == '"') return 1;
+    int value;
+    return is_declared_variable(p, only) || is_known_macro(p, only, &value);
+}
+
+// Primary expressions: numbers, names and strings, C calls "name(args)",
+// Yoda calls "(args)name" and parenthesized expressions. A C cast
+// "(type)name" is not an expression; see is_call.
+static int parse_primary(Parser* p) {
+    Token t = current_token(p);
+    if (t.type == TOKEN_NUMBER) {
+        advance(p);
+        return add_node(p, NODE_NUMBER, token_slice(t), (Slice){0, 0});
+    }
+    if (t.type == TOKEN_IDENTIFIER) {
+        int symbol = current_symbol(p);
+        advance(p);
+        if (!match(p, TOKEN_LPAREN)) return with_symbol(p, add_node(p, NODE_NAME, token_slice(t), (Slice){0, 0}), symbol);
+        int close_pos = p->current_token_pos + get_offset_after_paren(p) - 1;
+        Children call = {with_symbol(p, add_node(p, NODE_CALL, token_slice(t), (Slice){0, 0}), symbol), -1};
+        advance(p);
+        if (call.parent < 0 || !parse_arguments(p, &call, close_pos)) return -1;
+        advance(p);
+        return call.parent;
     }
-    int end_token_pos = p->current_token_pos;
+    if (t.type != TOKEN_LPAREN) return -1;
 
-    for (int i = start_token_pos; i < end_token_pos; i++) {
-        strncat(args_buffer, p->tokens.tokens[i].lexeme, sizeof(args_buffer) - strlen(args_buffer) - 1);
-        if (i < end_token_pos - 1 && peek_at(p, i - p->current_token_pos + 1).type != TOKEN_COMMA) {
-             strncat(args_buffer, " ", sizeof(args_buffer) - strlen(args_buffer) - 1);
+    int close_pos = p->current_token_pos + get_offset_after_paren(p) - 1;
+    Children group = {add_node(p, NODE_CALL, (Slice){0, 0}, (Slice){0, 0}), -1};
+    advance(p);
+    if (group.parent < 0 || !parse_arguments(p, &group, close_pos)) return -1;
+    advance(p);
+    AstNode* node = &p->ast.nodes[group.parent];
+    if (match(p, TOKEN_IDENTIFIER)) {
+        int symbol = current_symbol(p);
+        if (!is_call(p, node, symbol, token_slice(current_token(p)))) return -1;
+        node->symbol = symbol;
+        node->text = token_slice(advance(p));
+        return group.parent;
+    }
+    // Not a call: exactly one expression in parentheses.
+    if (node->first_child < 0 || p->ast.nodes[node->first_child].next_sibling >= 0) return -1;
+    node->kind = NODE_GROUP;
+    return group.parent;
+}
+
+static int parse_unary(Parser* p) {
+    Token t = current_token(p);
+    if (!is_prefix_operator(p, t)) return parse_primary(p);
+    advance(p);
+    int operand = parse_unary(p);
+    if (operand < 0) return -1;
+    return add_parent(p, NODE_UNARY, token_slice(t), operand, -1);
+}
+
+static int parse_expression(Parser* p, int min_precedence) {
+    int left = parse_unary(p);
+    while (left >= 0) {
+        Token op = current_token(p);
+        int precedence = binary_precedence(p, op);
+        if (precedence == PREC_NONE || precedence < min_precedence) break;
+        if (precedence == PREC_ASSIGN && p->ast.nodes[left].kind != NODE_NAME) return -1;
+        advance(p);
+        int right = parse_expression(p, precedence == PREC_ASSIGN ? PREC_ASSIGN : precedence + 1);
+        if (right < 0) return -1;
+        left = add_parent(p, precedence == PREC_ASSIGN ? NODE_ASSIGN : NODE_BINARY, token_slice(op), left, right);
+    }
+    return left;
+}
+
+// Backtracking support: tokens from the start of an attempt are kept in
+// the streaming ring until it is resolved, and nodes it built are dropped.
+typedef struct {
+    int pos;
+    int node_count;
+    int was_pinned;
+    int pin_pos;
+} ParseMark;
+
+static ParseMark mark_position(Parser* p) {
+    ParseMark mark = {p->current_token_pos, p->ast.count, p->pinned, p->pin_pos};
+    if (!p->pinned) {
+        p->pinned = 1;
+        p->pin_pos = p->current_token_pos;
+    }
+    return mark;
+}
+
+static void release_mark(Parser* p, ParseMark mark) {
+    p->pinned = mark.was_pinned;
+    p->pin_pos = mark.pin_pos;
+}
+
+static void rewind_to_mark(Parser* p, ParseMark mark) {
+    p->current_token_pos = mark.pos;
+    p->ast.count = mark.node_count;
+}
+
+// Parses an expression ending at a token of type end_type (at end_pos, if
+// end_pos >= 0) and adds it to parent. If the tokens are not an expression
+// they are added as a token list up to the first end_type, exactly as
+// before expressions were parsed.
+static void parse_expression_or_tokens(Parser* p, Children* parent, TokenType end_type, int end_pos) {
+    ParseMark mark = mark_position(p);
+    int expression = parse_expression(p, PREC_ASSIGN);
+    if (expression >= 0 && match(p, end_type) && (end_pos < 0 || p->current_token_pos == end_pos)) {
+        add_child(p, parent, expression);
+    } else {
+        rewind_to_mark(p, mark);
+        parse_tokens_until(p, parent, end_type);
+    }
+    release_mark(p, mark);
+}
+
+// A for header "init; condition; step" ending at the ')' at close_pos.
+// Returns 0 (having consumed nothing) if it does not have three clauses.
+static int parse_for_header(Parser* p, Children* loop, int close_pos) {
+    ParseMark mark = mark_position(p);
+    Children header = add_node_to(p, &(Children){-1, -1}, NODE_FOR_HEADER, (Slice){0, 0}, (Slice){0, 0});
+    int ok = header.parent >= 0;
+    for (int clause = 0; clause < 3 && ok; clause++) {
+        TokenType end_type = clause < 2 ? TOKEN_SEMICOLON : TOKEN_RPAREN;
+        if (match(p, end_type)) {
+            add_node_to(p, &header, NODE_EMPTY, (Slice){0, 0}, (Slice){0, 0});
+        } else {
+            parse_expression_or_tokens(p, &header, end_type, clause < 2 ? -1 : close_pos);
+        }
+        ok = clause < 2 ? match(p, TOKEN_SEMICOLON) && p->current_token_pos < close_pos
+                        : p->current_token_pos == close_pos;
+        if (clause < 2 && ok) advance(p);
+    }
+    if (ok) add_child(p, loop, header.parent);
+    else rewind_to_mark(p, mark);
+    release_mark(p, mark);
+    return ok;
+}
+
+// --- Statements ---
+
+static int parse_reversed_function_call(Parser* p, Children* block) {
+    // The name follows the arguments.
+    int close_pos = p->current_token_pos + get_offset_after_paren(p) - 1;
+    Children call = add_node_to(p, block, NODE_CALL, (Slice){0, 0}, (Slice){0, 0});
+    if (!consume(p, TOKEN_LPAREN, "Expected '(' for function call")) return 0;
+
+    ParseMark mark = mark_position(p);
+    if (!parse_arguments(p, &call, close_pos)) {
+        rewind_to_mark(p, mark);
+        if (call.parent >= 0) p->ast.nodes[call.parent].first_child = -1;
+        call.last = -1;
+        Children arguments = add_node_to(p, &call, NODE_EXPRESSION, (Slice){0, 0}, (Slice){0, 0});
+        while(p->current_token_pos < close_pos && !match(p, TOKEN_EOF)) {
+            add_node_to(p, &arguments, NODE_TOKEN, token_slice(advance(p)), (Slice){0, 0});
         }
     }
+    release_mark(p, mark);
 
     if (!consume(p, TOKEN_RPAREN, "Expected ')' to end function call arguments")) return 0;
-    Token func_name = current_token(p);
+    Token name = current_token(p);
+    int symbol = current_symbol(p);
     if (!consume(p, TOKEN_IDENTIFIER, "Expected function name")) return 0;
     if (!consume(p, TOKEN_SEMICOLON, "Expected ';' after function call")) return 0;
-    
-    char final_call[2048];
-    sprintf(final_call, "    %s(%s);\n", func_name.lexeme, args_buffer);
-    append_output(p, final_call);
+    if (call.parent >= 0) {
+        p->ast.nodes[call.parent].text = token_slice(name);
+        p->ast.nodes[call.parent].symbol = symbol;
+    }
     return 1;
 }
 
-int parse_for_loop(Parser* p) {
-    char condition[256] = {0};
+// Parses "{ statements }" into a NODE_BLOCK child of parent.
+static int parse_block(Parser* p, Children* parent, const char* open_message, const char* close_message) {
+    Children block = add_node_to(p, parent, NODE_BLOCK, (Slice){0, 0}, (Slice){0, 0});
+    if (!consume(p, TOKEN_LBRACE, open_message)) return 0;
+    while(!match(p, TOKEN_RBRACE) && !match(p, TOKEN_EOF)) {
+        if (!parse_statement(p, &block)) return 0;
+    }
+    return consume(p, TOKEN_RBRACE, close_message);
+}
+
+// "(condition)" up to the ')' matching the current '('.
+static void parse_condition(Parser* p, Children* parent) {
+    int close_pos = p->current_token_pos + get_offset_after_paren(p) - 1;
+    advance(p); // '('
+    parse_expression_or_tokens(p, parent, TOKEN_RPAREN, close_pos);
+}
+
+static int parse_for_loop(Parser* p, Children* block) {
+    Children loop = add_node_to(p, block, NODE_FOR, (Slice){0, 0}, (Slice){0, 0});
+    int close_pos = p->current_token_pos + get_offset_after_paren(p) - 1;
     if (!consume(p, TOKEN_LPAREN, "Expected '(' before for loop condition")) return 0;
-    slurp_tokens_until(p, TOKEN_RPAREN, condition, sizeof(condition));
+    if (!parse_for_header(p, &loop, close_pos)) parse_tokens_until(p, &loop, TOKEN_RPAREN);
     if (!consume(p, TOKEN_RPAREN, "Expected ')' after for loop condition")) return 0;
     if (!consume(p, TOKEN_KEYWORD, "Expected 'for' keyword after condition")) return 0;
-    
-    char temp_buffer[512];
-    sprintf(temp_buffer, "    for (%s) {\n", condition);
-    append_output(p, temp_buffer);
-    
-    if (!consume(p, TOKEN_LBRACE, "Expected '{' before for loop body")) return 0;
-    while(!match(p, TOKEN_RBRACE) && !match(p, TOKEN_EOF)) {
-        if (!parse_statement(p)) return 0;
-    }
-    if (!consume(p, TOKEN_RBRACE, "Expected '}' after for loop body")) return 0;
-    append_output(p, "    }\n");
-    return 1;
+    return parse_block(p, &loop, "Expected '{' before for loop body", "Expected '}' after for loop body");
 }
 
-int parse_while_loop(Parser* p) {
-    char condition[256] = {0};
-    if (!consume(p, TOKEN_LPAREN, "Expected '(' before while loop condition")) return 0;
-    slurp_tokens_until(p, TOKEN_RPAREN, condition, sizeof(condition));
+static int parse_while_loop(Parser* p, Children* block) {
+    Children loop = add_node_to(p, block, NODE_WHILE, (Slice){0, 0}, (Slice){0, 0});
+    if (!match(p, TOKEN_LPAREN)) return consume(p, TOKEN_LPAREN, "Expected '(' before while loop condition");
+    parse_condition(p, &loop);
     if (!consume(p, TOKEN_RPAREN, "Expected ')' after while loop condition")) return 0;
     if (!consume(p, TOKEN_KEYWORD, "Expected 'while' keyword after condition")) return 0;
-
-    char temp_buffer[512];
-    sprintf(temp_buffer, "    while (%s) {\n", condition);
-    append_output(p, temp_buffer);
-
-    if (!consume(p, TOKEN_LBRACE, "Expected '{' before while loop body")) return 0;
-    while(!match(p, TOKEN_RBRACE) && !match(p, TOKEN_EOF)) {
-        if (!parse_statement(p)) return 0;
-    }
-    if (!consume(p, TOKEN_RBRACE, "Expected '}' after while loop body")) return 0;
-    append_output(p, "    }\n");
-    return 1;
+    return parse_block(p, &loop, "Expected '{' before while loop body", "Expected '}' after while loop body");
 }
 
-int parse_if_statement(Parser* p) {
-    char condition[256] = {0};
-    int has_else = 0;
-
-    if (!consume(p, TOKEN_LPAREN, "Expected '(' before if condition")) return 0;
-    slurp_tokens_until(p, TOKEN_RPAREN, condition, sizeof(condition));
+static int parse_if_statement(Parser* p, Children* block) {
+    Children statement = add_node_to(p, block, NODE_IF, (Slice){0, 0}, (Slice){0, 0});
+    if (!match(p, TOKEN_LPAREN)) return consume(p, TOKEN_LPAREN, "Expected '(' before if condition");
+    parse_condition(p, &statement);
     if (!consume(p, TOKEN_RPAREN, "Expected ')' after if condition")) return 0;
     if (!consume(p, TOKEN_KEYWORD, "Expected 'if' keyword after condition")) return 0;
+    if (!parse_block(p, &statement, "Expected '{' before if body", "Expected '}' after if body")) return 0;
 
-    char temp_buffer[512];
-    sprintf(temp_buffer, "    if (%s) {\n", condition);
-    append_output(p, temp_buffer);
-
-    if (!consume(p, TOKEN_LBRACE, "Expected '{' before if body")) return 0;
-    while(!match(p, TOKEN_RBRACE) && !match(p, TOKEN_EOF)) {
-        if (!parse_statement(p)) return 0;
-    }
-    if (!consume(p, TOKEN_RBRACE, "Expected '}' after if body")) return 0;
-    append_output(p, "    }\n");
-    
-    if (match(p, TOKEN_KEYWORD) && strcmp(current_token(p).lexeme, "else") == 0) {
-        has_else = 1;
+    if (current_token(p).keyword == KEYWORD_ELSE) {
         advance(p); // consume 'else'
-        append_output(p, "    else {\n");
-        if (!consume(p, TOKEN_LBRACE, "Expected '{' before else body")) return 0;
-        while(!match(p, TOKEN_RBRACE) && !match(p, TOKEN_EOF)) {
-            if (!parse_statement(p)) return 0;
-        }
-        if (!consume(p, TOKEN_RBRACE, "Expected '}' after else body")) return 0;
-        append_output(p, "    }\n");
+        return parse_block(p, &statement, "Expected '{' before else body", "Expected '}' after else body");
     }
     return 1;
 }
 
-int parse_variable_declaration(Parser* p) {
+static int parse_variable_declaration(Parser* p, Children* block) {
     Token value = advance(p); // consume the number
     if (!consume(p, TOKEN_EQUALS, "Expected '=' after value in declaration")) return 0;
     Token name = current_token(p);
+    int symbol = current_symbol(p);
     if (!consume(p, TOKEN_IDENTIFIER, "Expected identifier name for variable")) return 0;
     Token type = current_token(p);
     if (!consume(p, TOKEN_KEYWORD, "Expected type keyword for variable")) return 0;
     if (!consume(p, TOKEN_SEMICOLON, "Expected ';' after variable declaration")) return 0;
 
-    char temp_buffer[512];
-    sprintf(temp_buffer, "    %s %s = %s;\n", type.lexeme, name.lexeme, value.lexeme);
-    append_output(p, temp_buffer);
+    Children declaration = add_node_to(p, block, NODE_DECL, token_slice(name), token_slice(type));
+    with_symbol(p, declaration.parent, symbol);
+    declare_variable(p, symbol, token_slice(name));
+    add_node_to(p, &declaration, NODE_NUMBER, token_slice(value), (Slice){0, 0});
     return 1;
 }
 
-int parse_statement(Parser* p) {
+static int parse_statement(Parser* p, Children* block) {
     if (match(p, TOKEN_NUMBER)) {
-        return parse_variable_declaration(p);
+        return parse_variable_declaration(p, block);
     }
     
     if (match(p, TOKEN_LPAREN)) {
         int offset = get_offset_after_paren(p);
         Token token_after_paren = peek_at(p, offset);
 
-        if (token_after_paren.type == TOKEN_KEYWORD) {
-            if (strcmp(token_after_paren.lexeme, "for") == 0) return parse_for_loop(p);
-            if (strcmp(token_after_paren.lexeme, "while") == 0) return parse_while_loop(p);
-            if (strcmp(token_after_paren.lexeme, "if") == 0) return parse_if_statement(p);
-        }
+        if (token_after_paren.keyword == KEYWORD_FOR) return parse_for_loop(p, block);
+        if (token_after_paren.keyword == KEYWORD_WHILE) return parse_while_loop(p, block);
+        if (token_after_paren.keyword == KEYWORD_IF) return parse_if_statement(p, block);
 
         if (token_after_paren.type == TOKEN_IDENTIFIER) {
             if (peek_at(p, offset + 1).type == TOKEN_SEMICOLON) {
-                return parse_reversed_function_call(p);
+                return parse_reversed_function_call(p, block);
             }
         }
     }
     
+    if (current_token(p).keyword == KEYWORD_RETURN) {
+        Children statement = add_node_to(p, block, NODE_RETURN, (Slice){0, 0}, (Slice){0, 0});
+        advance(p);
+        if (!match(p, TOKEN_SEMICOLON)) parse_expression_or_tokens(p, &statement, TOKEN_SEMICOLON, -1);
+        return consume(p, TOKEN_SEMICOLON, "Expected ';' after statement");
+    }
+
     if (match(p, TOKEN_KEYWORD) || match(p, TOKEN_IDENTIFIER)) {
-        char line[1024];
-        slurp_tokens_until(p, TOKEN_SEMICOLON, line, sizeof(line));
-        if (consume(p, TOKEN_SEMICOLON, "Expected ';' after statement")) {
-            append_output(p, "    ");
-            append_output(p, line);
-            append_output(p, ";\n");
-            return 1;
-        }
-        return 0;
+        Children statement = add_node_to(p, block, NODE_STATEMENT, (Slice){0, 0}, (Slice){0, 0});
+        parse_expression_or_tokens(p, &statement, TOKEN_SEMICOLON, -1);
+        return consume(p, TOKEN_SEMICOLON, "Expected ';' after statement");
     }
 
-    printf("Parser Error: Unrecognized statement starting with '%s'\n", current_token(p).lexeme);
+    Token t = current_token(p);
+    report_diagnostic(p->diagnostics, "Parser Error: Unrecognized statement starting with '%.*s'", lexeme_length(t), lexeme_start(&p->tokens, t));
     return 0;
 }
 
-int parse_function_declaration(Parser* p) {
-    char args[1024] = {0};
+static int parse_function_declaration(Parser* p) {
+    Children function = add_node_to(p, &(Children){-1, -1}, NODE_FUNCTION, (Slice){0, 0}, (Slice){0, 0});
     if (!consume(p, TOKEN_LPAREN, "Expected '(' before function arguments")) return 0;
     
     while(!match(p, TOKEN_RPAREN) && !match(p, TOKEN_EOF)) {
-        if (strlen(args) > 0) strcat(args, ", ");
         Token arg_name = current_token(p);
+        int arg_symbol = current_symbol(p);
         if(!consume(p, TOKEN_IDENTIFIER, "Expected argument name")) return 0;
         Token arg_type = current_token(p);
         if(!consume(p, TOKEN_KEYWORD, "Expected argument type")) return 0;
-        
-        strcat(args, arg_type.lexeme);
-        strcat(args, " ");
-        strcat(args, arg_name.lexeme);
+        with_symbol(p, add_node_to(p, &function, NODE_PARAM, token_slice(arg_name), token_slice(arg_type)).parent, arg_symbol);
+        declare_variable(p, arg_symbol, token_slice(arg_name));
 
         if (match(p, TOKEN_COMMA)) advance(p);
-        else if (!match(p, TOKEN_RPAREN)) { printf("Parser Error: Expected ',' or ')' in argument list.\n"); return 0; }
+        else if (!match(p, TOKEN_RPAREN)) { report_diagnostic(p->diagnostics, "Parser Error: Expected ',' or ')' in argument list."); return 0; }
     }
     if (!consume(p, TOKEN_RPAREN, "Expected ')' after function arguments")) return 0;
-
-    Token func_name = current_token(p);
+    Token name = current_token(p);
+    int symbol = current_symbol(p);
     if (!consume(p, TOKEN_IDENTIFIER, "Expected function name")) return 0;
-    Token return_type = current_token(p);
+    if (!declare_function(p->macros, p->allocator, p->tokens.source + name.offset, name.length)) {
+        p->out_of_memory = 1;
+        return 0;
+    }
+    NameInfo* info = name_info(p, symbol, token_slice(name));
+    if (info) info->function = 1;
+    Token type = current_token(p);
     if (!consume(p, TOKEN_KEYWORD, "Expected function return type")) return 0;
+    if (function.parent >= 0) {
+        p->ast.nodes[function.parent].symbol = symbol;
+        p->ast.nodes[function.parent].text = token_slice(name);
+        p->ast.nodes[function.parent].type = token_slice(type);
+    }
+    return parse_block(p, &function, "Expected '{' before function body", "Expected '}' after function body");
+}
+
+// --- Constant Folding ---
+
+// Runs on each declaration's tree between parsing and emission. Integer
+// expressions whose operands are all literals or known macros become their
+// value, and if/else arms and loops that a constant condition never enters
+// are dropped. Only what C computes the same way is folded: no overflow,
+// division by zero or INT_MIN (which has no int literal).
 
-    char func_header[2048];
-    sprintf(func_header, "%s %s(%s) {\n", return_type.lexeme, func_name.lexeme, args);
-    append_output(p, func_header);
+static unsigned int macro_hash(const char* name, int length) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < length; i++) h = (h ^ (unsigned char)name[i]) * 16777619u;
+    return h;
+}
 
-    if (!consume(p, TOKEN_LBRACE, "Expected '{' before function body")) return 0;
-    while (!match(p, TOKEN_RBRACE) && !match(p, TOKEN_EOF)) {
-        if (!parse_statement(p)) return 0;
+static Macro* find_macro_slot(const MacroTable* table, const char* name, int length) {
+    unsigned int mask = table->capacity - 1;
+    for (unsigned int i = macro_hash(name, length) & mask;; i = (i + 1) & mask) {
+        Macro* slot = &table->slots[i];
+        if (!slot->name || (slot->length == length && memcmp(slot->name, name, length) == 0)) return slot;
     }
-    if (!consume(p, TOKEN_RBRACE, "Expected '}' after function body")) return 0;
-    append_output(p, "}\n\n");
+}
+
+static int lookup_macro(const MacroTable* table, const char* name, int length, int* value) {
+    if (table->capacity == 0) return 0;
+    const Macro* slot = find_macro_slot(table, name, length);
+    if (!slot->name || !slot->known) return 0;
+    *value = slot->value;
     return 1;
 }
 
-char* parse(TokenList tokens) {
-    Parser p = {tokens, 0, NULL, 0, 0};
-    p.output = malloc(1); p.output[0] = '\0';
+static int is_function(const MacroTable* table, const char* name, int length) {
+    return table->capacity > 0 && find_macro_slot(table, name, length)->function;
+}
 
-    while(!match(&p, TOKEN_EOF)) {
-        if (match(&p, TOKEN_PREPROCESSOR)) {
-            append_output(&p, current_token(&p).lexeme);
-            append_output(&p, "\n");
-            advance(&p);
-        } else if (match(&p, TOKEN_LPAREN)) {
-            if(!parse_function_declaration(&p)) {
-                free(p.output);
-                return NULL;
-            }
-        } else {
-             printf("Parser Error: Only preprocessor directives or function definitions allowed at top level. Found '%s'.\n", current_token(&p).lexeme);
-             free(p.output);
-             return NULL;
+// The slot for name, added if it is missing. NULL when out of memory.
+static Macro* add_macro_slot(MacroTable* table, const YodaAllocator* allocator, const char* name, int length) {
+    if ((table->count + 1) * 2 > table->capacity) {
+        int capacity = table->capacity == 0 ? 16 : table->capacity * 2;
+        Macro* slots = yoda_realloc(allocator, NULL, capacity * sizeof(Macro));
+        if (!slots) return NULL;
+        memset(slots, 0, capacity * sizeof(Macro));
+        MacroTable grown = {slots, capacity, table->count, table->conditional_depth};
+        for (int i = 0; i < table->capacity; i++) {
+            if (table->slots[i].name) *find_macro_slot(&grown, table->slots[i].name, table->slots[i].length) = table->slots[i];
         }
+        yoda_free(allocator, table->slots);
+        *table = grown;
+    }
+    Macro* slot = find_macro_slot(table, name, length);
+    if (!slot->name) {
+        *slot = (Macro){name, length, 0, 0, 0};
+        table->count++;
     }
-    return p.output;
+    return slot;
 }
 
-// --- Main Driver ---
+// Records name as known to be value, or as unknown. Returns 0 when out of
+// memory.
+static int set_macro(MacroTable* table, const YodaAllocator* allocator, const char* name, int length, int known, int value) {
+    if (!known && (table->capacity == 0 || !find_macro_slot(table, name, length)->name)) return 1;
+    Macro* slot = add_macro_slot(table, allocator, name, length);
+    if (!slot) return 0;
+    slot->known = known;
+    slot->value = value;
+    return 1;
+}
 
-char* read_file(const char* path) {
-    FILE* file = fopen(path, "rb");
-    if (!file) { fprintf(stderr, "Could not open file \"%s\".\n", path); exit(74); }
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
-    char* buffer = (char*)malloc(fileSize + 1);
-    if (!buffer) { fprintf(stderr, "Not enough memory to read \"%s\".\n", path); exit(74); }
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize) { fprintf(stderr, "Could not read file \"%s\".\n", path); exit(74); }
-    buffer[bytesRead] = '\0';
-    fclose(file);
-    return buffer;
+// Records that the program declares a function called name. Returns 0 when
+// out of memory.
+static int declare_function(MacroTable* table, const YodaAllocator* allocator, const char* name, int length) {
+    Macro* slot = add_macro_slot(table, allocator, name, length);
+    if (!slot) return 0;
+    slot->function = 1;
+    return 1;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 2) { printf("Usage: %s <filename.ydc>\n", argv[0]); return 1; }
-    const char* source_file = argv[1];
-    char* source_code = read_file(source_file);
+#ifndef YODA_NO_MAIN
+// Like the token list, used only with libc's allocator; aborts if memory
+// runs out.
+static void copy_macro_table(MacroTable* copy, const MacroTable* table) {
+    *copy = *table;
+    if (table->capacity == 0) return;
+    copy->slots = malloc(table->capacity * sizeof(Macro));
+    if (!copy->slots) abort();
+    memcpy(copy->slots, table->slots, table->capacity * sizeof(Macro));
+}
+#endif
 
-    printf("--- Tokenizing ---\n");
-    TokenList tokens = tokenize(source_code);
-    
-    printf("\n--- Parsing & Transpiling ---\n");
-    char* c_code = parse(tokens);
-    if (!c_code) {
-        printf("Failed to transpile due to parsing errors.\n");
-        free(source_code);
-        free_tokens(&tokens);
+static void free_macro_table(MacroTable* table, const YodaAllocator* allocator) {
+    yoda_free(allocator, table->slots);
+    *table = (MacroTable){NULL, 0, 0, 0};
+}
+
+// Reads a literal of type int: decimal, or octal with a leading 0.
+static int parse_int_literal(const char* text, int length, int* value) {
+    if (length == 0) return 0;
+    int base = text[0] == '0' ? 8 : 10;
+    long long v = 0;
+    for (int i = 0; i < length; i++) {
+        if (CHAR_KIND(text[i]) != CHAR_DIGIT || text[i] - '0' >= base) return 0;
+        v = v * base + (text[i] - '0');
+        if (v > INT_MAX) return 0;
+    }
+    *value = (int)v;
+    return 1;
+}
+
+static const char* skip_blanks(const char* s, const char* end) {
+    while (s < end && CHAR_KIND(*s) == CHAR_SPACE) s++;
+    return s;
+}
+
+static const char* skip_identifier(const char* s, const char* end) {
+    while (s < end && (char_class[(unsigned char)*s] & CHAR_IDENT)) s++;
+    return s;
+}
+
+// Updates table for one preprocessor line. A macro defined or undefined
+// under #if may or may not be, so it becomes unknown; so does everything
+// on a quoted #include, which may redefine anything. Returns 0 when out
+// of memory.
+static int apply_directive(MacroTable* table, const YodaAllocator* allocator, const char* line, int length) {
+    const char* end = line + length;
+    const char* word = skip_blanks(line + 1, end);
+    const char* s = skip_identifier(word, end);
+    int word_length = s - word;
+    if ((word_length == 2 && memcmp(word, "if", 2) == 0) || (word_length == 5 && memcmp(word, "ifdef", 5) == 0) ||
+        (word_length == 6 && memcmp(word, "ifndef", 6) == 0)) {
+        table->conditional_depth++;
         return 1;
     }
-    printf("Transpiled C code:\n---\n%s---\n", c_code);
-    
-    printf("\n--- Compiling with GCC ---\n");
-    FILE* out_file = fopen("output.c", "w");
-    if (!out_file) { printf("Error: could not create output.c\n"); return 1; }
-    fprintf(out_file, "%s", c_code);
-    fclose(out_file);
-    
-    int result = system("gcc -o output output.c");
-    if (result == 0) {
-        printf("\nSuccess! Compiled to './output' executable.\n");
-    } else {
-        printf("\nGCC compilation failed.\n");
+    if (word_length == 5 && memcmp(word, "endif", 5) == 0) {
+        if (table->conditional_depth > 0) table->conditional_depth--;
+        return 1;
+    }
+    if (word_length == 7 && memcmp(word, "include", 7) == 0) {
+        const char* path = skip_blanks(s, end);
+        if (path < end && *path == '"') {
+            for (int i = 0; i < table->capacity; i++) table->slots[i].known = 0;
+        }
+        return 1;
     }
+    int define = word_length == 6 && memcmp(word, "define", 6) == 0;
+    if (!define && !(word_length == 5 && memcmp(word, "undef", 5) == 0)) return 1;
 
-    free(source_code);
-    free(c_code);
-    free_tokens(&tokens);
+    const char* name = skip_blanks(s, end);
+    s = skip_identifier(name, end);
+    if (s == name) return 1;
+    int value = 0, known = 0;
+    if (define && table->conditional_depth == 0 && s < end && *s != '(') {
+        const char* literal = skip_blanks(s, end);
+        const char* literal_end = end;
+        while (literal_end > literal && CHAR_KIND(literal_end[-1]) == CHAR_SPACE) literal_end--;
+        int negative = literal < literal_end && *literal == '-';
+        known = parse_int_literal(literal + negative, literal_end - literal - negative, &value);
+        if (negative) value = -value;
+    }
+    return set_macro(table, allocator, name, s - name, known, value);
+}
+
+static int fold_binary(const char* op, int op_length, long long a, long long b, long long* result) {
+    switch (op[0]) {
+    case '+': *result = a + b; return 1;
+    case '-': *result = a - b; return 1;
+    case '*': *result = a * b; return 1;
+    case '/': if (b == 0) return 0; *result = a / b; return 1;
+    case '%': if (b == 0) return 0; *result = a % b; return 1;
+    case '<': *result = op_length == 2 ? a <= b : a < b; return 1;
+    case '>': *result = op_length == 2 ? a >= b : a > b; return 1;
+    case '=': *result = a == b; return 1;
+    case '!': *result = a != b; return 1;
+    case '&': *result = a && b; return 1;
+    case '|': *result = a || b; return 1;
+    }
+    return 0;
+}
+
+static int fold_expression(Parser* p, int node, int* value);
+
+static void fold_arguments(Parser* p, int call) {
+    int value;
+    for (int i = p->ast.nodes[call].first_child; i >= 0; i = p->ast.nodes[i].next_sibling) {
+        fold_expression(p, i, &value);
+    }
+}
+
+// Folds the expression at node in place. Returns 1 and sets *value if it
+// is an integer constant; one that is not a lone literal or macro becomes
+// a NODE_CONSTANT. Folding never adds nodes, so n stays valid.
+static int fold_expression(Parser* p, int node, int* value) {
+    AstNode* n = &p->ast.nodes[node];
+    const char* text = p->tokens.source + n->text.offset;
+    int a, b;
+    long long result;
+    switch (n->kind) {
+    case NODE_CONSTANT:
+        *value = n->value;
+        return 1;
+    case NODE_NUMBER:
+        return parse_int_literal(text, n->text.length, value);
+    case NODE_NAME:
+        return is_known_macro(p, n, value);
+    case NODE_GROUP:
+        if (!fold_expression(p, n->first_child, &a)) return 0;
+        result = a;
+        break;
+    case NODE_UNARY:
+        if (!fold_expression(p, n->first_child, &a)) return 0;
+        result = text[0] == '-' ? -(long long)a : text[0] == '!' ? !a : a;
+        break;
+    case NODE_BINARY: {
+        int left = n->first_child;
+        int left_constant = fold_expression(p, left, &a);
+        int right_constant = fold_expression(p, p->ast.nodes[left].next_sibling, &b);
+        // As in C, "0 && x" and "1 || x" do not depend on x.
+        if (left_constant && n->text.length == 2 && (text[0] == '&' ? a == 0 : text[0] == '|' && a != 0)) {
+            result = text[0] == '|';
+            break;
+        }
+        if (!left_constant || !right_constant || !fold_binary(text, n->text.length, a, b, &result)) return 0;
+        break;
+    }
+    case NODE_ASSIGN:
+        fold_expression(p, p->ast.nodes[n->first_child].next_sibling, &a);
+        return 0;
+    case NODE_CALL:
+        fold_arguments(p, node);
+        return 0;
+    default:
+        return 0;
+    }
+    if (result <= INT_MIN || result > INT_MAX) return 0;
+    n->kind = NODE_CONSTANT;
+    n->value = (int)result;
+    n->first_child = -1;
+    *value = (int)result;
+    return 1;
+}
+
+// Whether the block declares a variable (a token-list statement may be a
+// C declaration), so its statements need its braces as their scope.
+static int declares_variables(Parser* p, int block) {
+    for (int i = p->ast.nodes[block].first_child; i >= 0; i = p->ast.nodes[i].next_sibling) {
+        const AstNode* n = &p->ast.nodes[i];
+        if (n->kind == NODE_DECL) return 1;
+        if (n->kind == NODE_STATEMENT && p->ast.nodes[n->first_child].kind == NODE_EXPRESSION) return 1;
+    }
+    return 0;
+}
+
+static void fold_block(Parser* p, int block);
+
+// Folds a statement and returns what takes its place: the statement, -1
+// if it never has an effect, or a NODE_BLOCK whose statements replace it.
+static int fold_statement(Parser* p, int node) {
+    AstNode* n = &p->ast.nodes[node];
+    int value;
+    switch (n->kind) {
+    case NODE_DECL:
+    case NODE_STATEMENT:
+    case NODE_RETURN:
+        if (n->first_child >= 0) fold_expression(p, n->first_child, &value);
+        return node;
+    case NODE_CALL:
+        fold_arguments(p, node);
+        return node;
+    case NODE_IF: {
+        int then_block = p->ast.nodes[n->first_child].next_sibling;
+        int else_block = p->ast.nodes[then_block].next_sibling;
+        fold_block(p, then_block);
+        if (else_block >= 0) fold_block(p, else_block);
+        if (!fold_expression(p, n->first_child, &value)) return node;
+        return value ? then_block : else_block;
+    }
+    case NODE_WHILE:
+        fold_block(p, p->ast.nodes[n->first_child].next_sibling);
+        return fold_expression(p, n->first_child, &value) && value == 0 ? -1 : node;
+    case NODE_FOR: {
+        int header = n->first_child;
+        fold_block(p, p->ast.nodes[header].next_sibling);
+        if (p->ast.nodes[header].kind != NODE_FOR_HEADER) return node;
+        int init = p->ast.nodes[header].first_child;
+        int condition = p->ast.nodes[init].next_sibling;
+        fold_expression(p, init, &value);
+        fold_expression(p, p->ast.nodes[condition].next_sibling, &value);
+        if (!fold_expression(p, condition, &value) || value != 0) return node;
+        // Only the initialization runs.
+        if (p->ast.nodes[init].kind == NODE_EMPTY) return -1;
+        if (p->ast.nodes[init].kind == NODE_EXPRESSION) return node;
+        n->kind = NODE_STATEMENT;
+        n->first_child = init;
+        p->ast.nodes[init].next_sibling = -1;
+        return node;
+    }
+    default:
+        return node;
+    }
+}
+
+static void fold_block(Parser* p, int block) {
+    AstNode* nodes = p->ast.nodes;
+    int* link = &nodes[block].first_child;
+    while (*link >= 0) {
+        int statement = *link;
+        int next = nodes[statement].next_sibling;
+        int replacement = fold_statement(p, statement);
+        if (replacement == statement) {
+            link = &nodes[statement].next_sibling;
+        } else if (replacement < 0 || nodes[replacement].first_child < 0) {
+            *link = next;
+        } else if (declares_variables(p, replacement)) {
+            *link = replacement;
+            nodes[replacement].next_sibling = next;
+            link = &nodes[replacement].next_sibling;
+        } else {
+            int last = nodes[replacement].first_child;
+            while (nodes[last].next_sibling >= 0) last = nodes[last].next_sibling;
+            *link = nodes[replacement].first_child;
+            nodes[last].next_sibling = next;
+            link = &nodes[last].next_sibling;
+        }
+    }
+}
+
+// Folds the declaration's tree (the root is node 0), or records the
+// macro a directive defines.
+static void fold_declaration(Parser* p) {
+    const AstNode* root = &p->ast.nodes[0];
+    if (root->kind == NODE_PREPROCESSOR) {
+        if (!apply_directive(p->macros, p->allocator, p->tokens.source + root->text.offset, root->text.length)) {
+            p->out_of_memory = 1;
+        }
+        return;
+    }
+    int child = root->first_child;
+    while (p->ast.nodes[child].kind == NODE_PARAM) child = p->ast.nodes[child].next_sibling;
+    fold_block(p, child);
+}
+
+// --- Emission ---
+
+static void append_slice(Parser* p, Slice s) { append_output_n(p, p->tokens.source + s.offset, s.length); }
+
+// Expressions are written as their tokens separated by single spaces, the
+// way token lists always were; *first suppresses the space before the
+// first word. Calls are written C style, "name(a, b)".
+static void emit_word(Parser* p, const char* text, int length, int* first) {
+    if (!*first) append_output_n(p, " ", 1);
+    append_output_n(p, text, length);
+    *first = 0;
+}
+
+static void emit_expression(Parser* p, int node, int* first);
+
+// A call's arguments, comma separated. A token list (arguments that did not
+// parse) keeps its commas attached to the preceding token.
+static void emit_arguments(Parser* p, int call) {
+    const AstNode* nodes = p->ast.nodes;
+    int argument = nodes[call].first_child;
+    if (argument >= 0 && nodes[argument].kind == NODE_EXPRESSION) {
+        int first = 1;
+        for (int i = nodes[argument].first_child; i >= 0; i = nodes[i].next_sibling) {
+            Slice text = nodes[i].text;
+            if (text.length == 1 && p->tokens.source[text.offset] == ',') first = 1;
+            emit_word(p, p->tokens.source + text.offset, text.length, &first);
+        }
+        return;
+    }
+    for (int i = argument; i >= 0; i = nodes[i].next_sibling) {
+        if (i != argument) append_output(p, ", ");
+        int first = 1;
+        emit_expression(p, i, &first);
+    }
+}
+
+static void emit_expression(Parser* p, int node, int* first) {
+    const AstNode* n = &p->ast.nodes[node];
+    const char* text = p->tokens.source + n->text.offset;
+    switch (n->kind) {
+    case NODE_EXPRESSION:
+        for (int i = n->first_child; i >= 0; i = p->ast.nodes[i].next_sibling) {
+            Slice token = p->ast.nodes[i].text;
+            emit_word(p, p->tokens.source + token.offset, token.length, first);
+        }
+        break;
+    case NODE_NUMBER:
+    case NODE_NAME:
+        emit_word(p, text, n->text.length, first);
+        break;
+    case NODE_CONSTANT: {
+        char digits[16];
+        emit_word(p, digits, snprintf(digits, sizeof(digits), "%d", n->value), first);
+        break;
+    }
+    case NODE_UNARY:
+        emit_word(p, text, n->text.length, first);
+        emit_expression(p, n->first_child, first);
+        break;
+    case NODE_BINARY:
+    case NODE_ASSIGN:
+        emit_expression(p, n->first_child, first);
+        emit_word(p, text, n->text.length, first);
+        emit_expression(p, p->ast.nodes[n->first_child].next_sibling, first);
+        break;
+    case NODE_GROUP:
+        emit_word(p, "(", 1, first);
+        emit_expression(p, n->first_child, first);
+        emit_word(p, ")", 1, first);
+        break;
+    case NODE_CALL:
+        emit_word(p, text, n->text.length, first);
+        append_output(p, "(");
+        emit_arguments(p, node);
+        append_output(p, ")");
+        break;
+    case NODE_FOR_HEADER: {
+        int clause = n->first_child;
+        for (int i = 0; i < 3; i++, clause = p->ast.nodes[clause].next_sibling) {
+            if (i > 0) emit_word(p, ";", 1, first);
+            if (p->ast.nodes[clause].kind != NODE_EMPTY) emit_expression(p, clause, first);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static void emit_statement(Parser* p, int node);
+
+static void emit_block(Parser* p, int block) {
+    for (int i = p->ast.nodes[block].first_child; i >= 0; i = p->ast.nodes[i].next_sibling) {
+        emit_statement(p, i);
+    }
+}
+
+// The header of an if, while or for: "    <keyword> (<header>) {", then
+// the body.
+static void emit_loop_or_if(Parser* p, int node, const char* keyword) {
+    int header = p->ast.nodes[node].first_child;
+    append_output(p, "    ");
+    append_output(p, keyword);
+    append_output(p, " (");
+    int first = 1;
+    emit_expression(p, header, &first);
+    append_output(p, ") {\n");
+    int body = p->ast.nodes[header].next_sibling;
+    emit_block(p, body);
+    append_output(p, "    }\n");
+    int else_body = p->ast.nodes[body].next_sibling;
+    if (else_body >= 0) {
+        append_output(p, "    else {\n");
+        emit_block(p, else_body);
+        append_output(p, "    }\n");
+    }
+}
+
+static void emit_statement(Parser* p, int node) {
+    const AstNode* n = &p->ast.nodes[node];
+    int first = 1;
+    switch (n->kind) {
+    case NODE_DECL:
+        append_output(p, "    ");
+        append_slice(p, n->type);
+        append_output(p, " ");
+        append_slice(p, n->text);
+        append_output(p, " = ");
+        emit_expression(p, n->first_child, &first);
+        append_output(p, ";\n");
+        break;
+    case NODE_CALL:
+        append_output(p, "    ");
+        append_slice(p, n->text);
+        append_output(p, "(");
+        emit_arguments(p, node);
+        append_output(p, ");\n");
+        break;
+    case NODE_IF: emit_loop_or_if(p, node, "if"); break;
+    case NODE_WHILE: emit_loop_or_if(p, node, "while"); break;
+    case NODE_FOR: emit_loop_or_if(p, node, "for"); break;
+    case NODE_BLOCK: // a branch kept by folding that has declarations
+        append_output(p, "    {\n");
+        emit_block(p, node);
+        append_output(p, "    }\n");
+        break;
+    case NODE_RETURN:
+        append_output(p, "    return");
+        if (n->first_child >= 0) {
+            append_output(p, " ");
+            emit_expression(p, n->first_child, &first);
+        }
+        append_output(p, ";\n");
+        break;
+    case NODE_STATEMENT:
+        append_output(p, "    ");
+        emit_expression(p, n->first_child, &first);
+        append_output(p, ";\n");
+        break;
+    default:
+        break;
+    }
+}
+
+// Emits a top-level declaration (the tree's root, node 0).
+static void emit_declaration(Parser* p) {
+    const AstNode* root = &p->ast.nodes[0];
+    if (root->kind == NODE_PREPROCESSOR) {
+        append_slice(p, root->text);
+        append_output(p, "\n");
+        return;
+    }
+    append_slice(p, root->type);
+    append_output(p, " ");
+    append_slice(p, root->text);
+    append_output(p, "(");
+    int child = root->first_child;
+    for (int first = 1; p->ast.nodes[child].kind == NODE_PARAM; first = 0) {
+        if (!first) append_output(p, ", ");
+        append_slice(p, p->ast.nodes[child].type);
+        append_output(p, " ");
+        append_slice(p, p->ast.nodes[child].text);
+        child = p->ast.nodes[child].next_sibling;
+    }
+    append_output(p, ") {\n");
+    emit_block(p, child);
+    append_output(p, "}\n\n");
+}
+
+// Hands the output built so far to the sink and starts over, so a caller
+// with a sink never holds more than about one declaration's worth of C.
+#define OUTPUT_FLUSH_SIZE 65536
+
+static void flush_output(Parser* p) {
+    p->sink->write(p->sink->ctx, p->output, p->output_size);
+    p->output_size = 0;
+    p->output[0] = '\0';
+}
+
+// Parses top-level declarations until EOF or until end_pos is reached,
+// emitting each one as soon as its tree is complete.
+// Returns the output, or NULL on a parse error or when out of memory.
+static char* parse_program(Parser* p, int end_pos) {
+    p->output = yoda_realloc(p->allocator, NULL, 1);
+    if (!p->output) { p->out_of_memory = 1; return NULL; }
+    p->output[0] = '\0';
+    p->output_capacity = 1;
+    MacroTable own_macros = {NULL, 0, 0, 0};
+    if (!p->macros) p->macros = &own_macros;
+
+    int ok = 1;
+    while(ok && !match(p, TOKEN_EOF) && p->current_token_pos < end_pos) {
+        p->ast.count = 0;
+        p->names.count = 0;
+        p->names.generation++;
+        if (match(p, TOKEN_PREPROCESSOR)) {
+            add_node(p, NODE_PREPROCESSOR, token_slice(advance(p)), (Slice){0, 0});
+        } else if (match(p, TOKEN_LPAREN)) {
+            ok = parse_function_declaration(p);
+        } else {
+             Token t = current_token(p);
+             report_diagnostic(p->diagnostics, "Parser Error: Only preprocessor directives or function definitions allowed at top level. Found '%.*s'.", lexeme_length(t), lexeme_start(&p->tokens, t));
+             ok = 0;
+        }
+        if (!ok || p->out_of_memory) break;
+        fold_declaration(p);
+        if (p->out_of_memory) break;
+        if (!p->vm) emit_declaration(p);
+        else if (!compile_declaration(p)) { ok = 0; break; }
+        if (p->sink && p->output_size >= OUTPUT_FLUSH_SIZE) flush_output(p);
+    }
+    yoda_free(p->allocator, p->ast.nodes);
+    p->ast = (Ast){NULL, 0, 0};
+    yoda_free(p->allocator, p->names.slots);
+    p->names = (NameTable){NULL, 0, 0, 0};
+    if (p->macros == &own_macros) {
+        free_macro_table(&own_macros, p->allocator);
+        p->macros = NULL;
+    }
+    if (!ok || p->out_of_memory || p->too_many_tokens) {
+        yoda_free(p->allocator, p->output);
+        return NULL;
+    }
+    return p->output;
+}
+
+// Frees the token ring and bracket stacks of a streaming parser.
+static void release_token_stream(Parser* p) {
+    yoda_free(p->allocator, p->tokens.offsets);
+    yoda_free(p->allocator, p->symbol_table.slots);
+    yoda_free(p->allocator, p->open_parens.positions);
+    yoda_free(p->allocator, p->open_braces.positions);
+}
+
+#ifndef YODA_NO_MAIN
+static char* parse(TokenList tokens) {
+    Parser p = {.tokens = tokens};
+    return parse_program(&p, INT_MAX);
+}
+
+// Transpiles straight from the source, pulling tokens from the lexer as
+// the parser needs them instead of tokenizing the whole file first.
+static char* parse_source(const char* source, size_t length) {
+    Lexer lexer;
+    init_lexer(&lexer, source, length);
+    Parser p = {.tokens = {.source = source}, .lexer = &lexer};
+    char* output = parse_program(&p, INT_MAX);
+    release_token_stream(&p);
+    return output;
+}
+
+// --- Worker Pool ---
+
+// Runs fn(ctx, i) for every i in [0, count) on up to num_threads threads.
+// Workers claim the next index atomically, so uneven jobs balance out.
+typedef void (*WorkFn)(void* ctx, int index);
+
+typedef struct {
+    WorkFn fn;
+    void* ctx;
+    int count;
+    atomic_int next;
+} WorkQueue;
+
+static void* work_queue_worker(void* arg) {
+    WorkQueue* queue = arg;
+    for (;;) {
+        int index = atomic_fetch_add(&queue->next, 1);
+        if (index >= queue->count) return NULL;
+        queue->fn(queue->ctx, index);
+    }
+}
+
+static void run_parallel(int count, int num_threads, WorkFn fn, void* ctx) {
+    WorkQueue queue = {fn, ctx, count, 0};
+    if (num_threads > count) num_threads = count;
+    if (num_threads <= 1) { work_queue_worker(&queue); return; }
+    pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+    int started = 0;
+    for (; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, work_queue_worker, &queue) != 0) break;
+    }
+    if (started == 0) work_queue_worker(&queue);
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+// --- Parallel Transpilation ---
+
+// A top-level declaration: tokens [start, end) of the shared TokenList.
+// Workers parse chunks independently; diagnostics are captured per chunk
+// so they can be replayed in source order.
+typedef struct {
+    int start;
+    int end;
+    char* output;
+    char* diagnostics;
+    size_t diagnostics_size;
+    int stopped_at; // token position the parser ended on
+    MacroTable macros; // the #defines in effect where it starts
+} FunctionChunk;
+
+// Splits the stream at top-level declaration boundaries using the bracket
+// index: a function spans '(' args ')' name type '{' body '}'. Consecutive
+// declarations are grouped until a chunk holds at least chunk_tokens
+// tokens, to keep per-chunk overhead low. Anything that does not have the
+// expected shape ends the split; the rest of the file becomes one chunk
+// and the parser reports the problem.
+static int split_top_level(const TokenList* tokens, int chunk_tokens, FunctionChunk** chunks_out) {
+    int capacity = 64, count = 0;
+    FunctionChunk* chunks = malloc(capacity * sizeof(FunctionChunk));
+    int pos = 0;
+    int eof_pos = tokens->count - 1;
+    while (pos < eof_pos) {
+        int start = pos;
+        int close = tokens->partners[pos];
+        if (tokens->types[pos] == TOKEN_PREPROCESSOR) {
+            pos++;
+        } else if (tokens->types[pos] == TOKEN_LPAREN && close >= 0 && close + 3 < eof_pos &&
+                   tokens->types[close + 3] == TOKEN_LBRACE && tokens->partners[close + 3] >= 0) {
+            pos = tokens->partners[close + 3] + 1;
+        } else {
+            pos = eof_pos;
+        }
+        if (count > 0 && chunks[count - 1].end - chunks[count - 1].start < chunk_tokens) {
+            chunks[count - 1].end = pos;
+            continue;
+        }
+        if (count >= capacity) {
+            capacity *= 2;
+            chunks = realloc(chunks, capacity * sizeof(FunctionChunk));
+        }
+        chunks[count++] = (FunctionChunk){start, pos, NULL, NULL, 0, 0, {NULL, 0, 0, 0}};
+    }
+    *chunks_out = chunks;
+    return count;
+}
+
+typedef struct {
+    TokenList tokens;
+    FunctionChunk* chunks;
+} ChunkJob;
+
+static void transpile_chunk(void* ctx, int index) {
+    ChunkJob* job = ctx;
+    FunctionChunk* chunk = &job->chunks[index];
+    FILE* stream = open_memstream(&chunk->diagnostics, &chunk->diagnostics_size);
+    YodaDiagnostics diagnostics = {write_diagnostic_to_file, stream};
+    Parser p = {.tokens = job->tokens, .current_token_pos = chunk->start, .diagnostics = stream ? &diagnostics : NULL,
+                .macros = &chunk->macros};
+    chunk->output = parse_program(&p, chunk->end);
+    chunk->stopped_at = p.current_token_pos;
+    free_macro_table(&chunk->macros, NULL);
+    if (stream) fclose(stream);
+}
+
+// Transpiles the top-level functions of a fully tokenized file concurrently
+// and stitches the results back in source order. The result is identical
+// to parse(tokens): if any chunk's parse strays outside its boundaries
+// (only possible for malformed input) the whole file is reparsed serially.
+static char* parse_parallel(TokenList tokens, int num_threads) {
+    FunctionChunk* chunks;
+    int count = split_top_level(&tokens, tokens.count / (num_threads * 8) + 1, &chunks);
+    MacroTable macros = {NULL, 0, 0, 0};
+    for (int i = 0, pos = 0; i < count; i++) {
+        while (pos < chunks[i].start) {
+            if (tokens.types[pos] == TOKEN_PREPROCESSOR) {
+                apply_directive(&macros, NULL, tokens.source + tokens.offsets[pos], tokens.lengths[pos]);
+                pos++;
+                continue;
+            }
+            // A function, shaped as split_top_level found it.
+            int name = tokens.partners[pos] + 1;
+            if (!declare_function(&macros, NULL, tokens.source + tokens.offsets[name], tokens.lengths[name])) abort();
+            pos = tokens.partners[name + 2] + 1;
+        }
+        copy_macro_table(&chunks[i].macros, &macros);
+    }
+    free_macro_table(&macros, NULL);
+    ChunkJob job = {tokens, chunks};
+    run_parallel(count, num_threads, transpile_chunk, &job);
+
+    int serial_fallback = 0;
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        if (chunks[i].output && chunks[i].stopped_at != chunks[i].end) serial_fallback = 1;
+        if (chunks[i].output) total += strlen(chunks[i].output);
+    }
+
+    char* output = NULL;
+    if (!serial_fallback) {
+        output = malloc(total + 1);
+        size_t size = 0;
+        for (int i = 0; i < count; i++) {
+            if (chunks[i].diagnostics) fwrite(chunks[i].diagnostics, 1, chunks[i].diagnostics_size, stdout);
+            if (!chunks[i].output) { free(output); output = NULL; break; }
+            size_t len = strlen(chunks[i].output);
+            memcpy(output + size, chunks[i].output, len);
+            size += len;
+        }
+        if (output) output[size] = '\0';
+    }
+    for (int i = 0; i < count; i++) {
+        free(chunks[i].output);
+        free(chunks[i].diagnostics);
+    }
+    free(chunks);
+    return serial_fallback ? parse(tokens) : output;
+}
+#endif
+
+// --- Library Interface ---
+
+static void discard_output(void* ctx, const char* data, size_t length) {
+    (void)ctx;
+    (void)data;
+    (void)length;
+}
+
+YodaStatus yoda_transpile_with_allocator(const char* source, size_t length, const YodaSink* sink,
+                                         const YodaDiagnostics* diagnostics, const YodaAllocator* allocator) {
+    static const YodaSink no_sink = {discard_output, NULL};
+    if (!sink) sink = &no_sink;
+    if (!diagnostics) diagnostics = &quiet_diagnostics;
+    Lexer lexer;
+    init_lexer(&lexer, source, length);
+    lexer.diagnostics = diagnostics;
+    Parser p = {.tokens = {.source = source}, .lexer = &lexer, .diagnostics = diagnostics,
+                .allocator = allocator, .sink = sink};
+    char* output = parse_program(&p, INT_MAX);
+    if (output) {
+        flush_output(&p);
+        yoda_free(allocator, output);
+    }
+    release_token_stream(&p);
+    if (p.out_of_memory) return YODA_OUT_OF_MEMORY;
+    return output ? YODA_OK : YODA_PARSE_ERROR;
+}
+
+YodaStatus yoda_transpile(const char* source, size_t length, const YodaSink* sink,
+                          const YodaDiagnostics* diagnostics) {
+    return yoda_transpile_with_allocator(source, length, sink, diagnostics, NULL);
+}
+
+// --- Bytecode VM ---
+
+// "yoda run" compiles each function's tree to register bytecode and
+// interprets it, so a script runs without starting a C compiler. Registers
+// are 64-bit and hold ints (kept in int range, wrapping like the machine
+// does) or pointers into the program's string literals. A call's registers
+// are a window of one register stack: the caller evaluates the arguments
+// into consecutive registers, which become the callee's first ones.
+//
+// Instructions are r[a] = ... with operands b and c; c is a register, a
+// constant, a jump target or a function, depending on the opcode.
+#define VM_OPCODES(X) \
+    X(LOADK)    /* r[a] = c */                              \
+    X(LOADS)    /* r[a] = strings + c */                    \
+    X(MOVE)     /* r[a] = r[b] */                           \
+    X(ADD) X(SUB) X(MUL) X(DIV) X(MOD) /* r[a] = r[b] op r[c] */ \
+    X(LT) X(LE) X(GT) X(GE) X(EQ) X(NE)                     \
+    X(NEG) X(NOT) X(BOOL) /* r[a] = -r[b], !r[b], !!r[b] */ \
+    X(JUMP)     /* goto c */                                \
+    X(JZ)       /* if (!r[a]) goto c */                     \
+    X(JNZ)      /* if (r[a]) goto c */                      \
+    X(CALL)     /* r[a] = functions[c](r[b], ...) */        \
+    X(BUILTIN)  /* r[a] = builtin c & 0xFF of (c >> 8) arguments from r[b] */ \
+    X(PRINTF)   /* r[a] = printf(strings + c, (b >> 8) arguments from r[b & 0xFF]) */ \
+    X(RETURN)   /* return r[a] */                           \
+    X(RETURN0)  /* return 0 */
+
+typedef enum {
+#define VM_OPCODE_ENUM(name) OP_##name,
+    VM_OPCODES(VM_OPCODE_ENUM)
+#undef VM_OPCODE_ENUM
+    NUM_OPCODES
+} OpCode;
+
+typedef struct {
+    uint8_t op;
+    uint8_t a;
+    uint16_t b;
+    int32_t c;
+} Instruction;
+
+#define VM_MAX_REGISTERS 256    // a is one byte
+#define VM_MAX_CALL_DEPTH 100000
+#define VM_MAX_PROMOTED_PARAMS 6
+
+enum { BUILTIN_PRINTF, BUILTIN_PUTS, BUILTIN_PUTCHAR, NUM_BUILTINS };
+static const char* builtin_names[NUM_BUILTINS] = {"printf", "puts", "putchar"};
+
+typedef struct {
+    Slice name;
+    int defined;
+    int num_params;    // -1 until it is defined or called
+    int num_registers;
+    int entry;         // index of its first instruction
+    int int_signature; // returns int and takes at most VM_MAX_PROMOTED_PARAMS ints
+} VmFunction;
+
+typedef struct {
+    int symbol;
+    int reg;
+} VmLocal;
+
+typedef struct VmProgram {
+    const char* source;
+    Instruction* code;
+    int code_count;
+    int code_capacity;
+    char* strings;     // the string literals, each NUL-terminated
+    int strings_size;
+    int strings_capacity;
+    VmFunction* functions;
+    int function_count;
+    int function_capacity;
+    // State of the function being compiled
+    VmLocal* locals;   // innermost last
+    int local_count;
+    int local_capacity;
+    int next_register;
+    int max_registers;
+} VmProgram;
+
+static int slices_equal(const char* source, Slice a, Slice b) {
+    return a.length == b.length && memcmp(source + a.offset, source + b.offset, a.length) == 0;
+}
+
+static int slice_equals(const char* source, Slice a, const char* str) {
+    return strncmp(source + a.offset, str, a.length) == 0 && str[a.length] == '\0';
+}
+
+static int vm_error(Parser* p, Slice at, const char* message) {
+    report_diagnostic(p->diagnostics, "VM Error: %s '%.*s'", message, at.length, p->tokens.source + at.offset);
     return 0;
 }
 
+// The first token of node, to point error messages at.
+static Slice node_location(Parser* p, int node) {
+    const AstNode* n = &p->ast.nodes[node];
+    while (n->text.length == 0 && n->first_child >= 0) n = &p->ast.nodes[n->first_child];
+    return n->text;
+}
+
+// Reports that memory ran out while compiling the declaration's function.
+static int vm_out_of_memory(Parser* p) {
+    return vm_error(p, p->ast.nodes[0].text, "out of memory compiling");
+}
+
+// Appends an instruction and returns its index, or -1 (after reporting
+// it) if memory runs out.
+static int emit_instruction(Parser* p, VmProgram* vm, OpCode op, int a, int b, int c) {
+    if (vm->code_count == vm->code_capacity) {
+        int capacity = vm->code_capacity == 0 ? 256 : vm->code_capacity * 2;
+        Instruction* code = realloc(vm->code, capacity * sizeof(Instruction));
+        if (!code) {
+            vm_out_of_memory(p);
+            return -1;
+        }
+        vm->code = code;
+        vm->code_capacity = capacity;
+    }
+    vm->code[vm->code_count] = (Instruction){op, a, b, c};
+    return vm->code_count++;
+}
+
+static void patch_jump(VmProgram* vm, int jump) { vm->code[jump].c = vm->code_count; }
+
+// Returns a fresh register, or -1 if the function needs too many.
+static int new_register(Parser* p, VmProgram* vm, int node) {
+    if (vm->next_register == VM_MAX_REGISTERS) {
+        vm_error(p, node_location(p, node), "too many registers needed at");
+        return -1;
+    }
+    if (vm->next_register == vm->max_registers) vm->max_registers++;
+    return vm->next_register++;
+}
+
+// Returns 0 (after reporting it) if memory runs out.
+static int add_local(Parser* p, VmProgram* vm, int symbol, int reg) {
+    if (vm->local_count == vm->local_capacity) {
+        int capacity = vm->local_capacity == 0 ? 32 : vm->local_capacity * 2;
+        VmLocal* locals = realloc(vm->locals, capacity * sizeof(VmLocal));
+        if (!locals) return vm_out_of_memory(p);
+        vm->locals = locals;
+        vm->local_capacity = capacity;
+    }
+    vm->locals[vm->local_count++] = (VmLocal){symbol, reg};
+    return 1;
+}
+
+static int find_local(const VmProgram* vm, int symbol) {
+    for (int i = vm->local_count - 1; i >= 0; i--) {
+        if (vm->locals[i].symbol == symbol) return vm->locals[i].reg;
+    }
+    return -1;
+}
+
+// Copies a string literal (with its quotes) into the pool, resolving
+// escapes, and returns its offset, or -1 (after reporting it) if memory
+// runs out.
+static int add_string_literal(Parser* p, VmProgram* vm, Slice literal) {
+    const char* s = vm->source + literal.offset + 1;
+    const char* end = vm->source + literal.offset + literal.length - 1;
+    if (vm->strings_size + literal.length + 1 > vm->strings_capacity) {
+        int capacity = (vm->strings_size + literal.length + 1) * 2;
+        char* strings = realloc(vm->strings, capacity);
+        if (!strings) {
+            vm_out_of_memory(p);
+            return -1;
+        }
+        vm->strings = strings;
+        vm->strings_capacity = capacity;
+    }
+    int offset = vm->strings_size;
+    char* out = vm->strings + offset;
+    while (s < end) {
+        char c = *s++;
+        if (c == '\\' && s < end) {
+            c = *s++;
+            switch (c) {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case 'a': c = '\a'; break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'v': c = '\v'; break;
+            case 'x': {
+                int value = 0;
+                for (; s < end && isxdigit((unsigned char)*s); s++) {
+                    value = value * 16 + (isdigit((unsigned char)*s) ? *s - '0' : (*s | 0x20) - 'a' + 10);
+                }
+                c = (char)value;
+                break;
+            }
+            default:
+                if (c >= '0' && c <= '7') {
+                    int value = c - '0';
+                    for (int i = 0; i < 2 && s < end && *s >= '0' && *s <= '7'; i++) value = value * 8 + (*s++ - '0');
+                    c = (char)value;
+                }
+                break; // \\ \" \' and \? stand for themselves
+            }
+        }
+        *out++ = c;
+    }
+    *out++ = '\0';
+    vm->strings_size = out - vm->strings;
+    return offset;
+}
+
+// The function that node names, added (undefined) on first mention, or -1
+// (after reporting it) if memory runs out. The index is kept with the
+// name's symbol, so the functions are searched once per name and
+// declaration.
+static int find_function(Parser* p, VmProgram* vm, const AstNode* node) {
+    NameInfo* info = name_info(p, node->symbol, node->text);
+    if (info && info->vm_function >= 0) return info->vm_function;
+    int function = 0;
+    while (function < vm->function_count && !slices_equal(vm->source, vm->functions[function].name, node->text)) function++;
+    if (function == vm->function_count) {
+        if (vm->function_count == vm->function_capacity) {
+            int capacity = vm->function_capacity == 0 ? 16 : vm->function_capacity * 2;
+            VmFunction* functions = realloc(vm->functions, capacity * sizeof(VmFunction));
+            if (!functions) {
+                vm_out_of_memory(p);
+                return -1;
+            }
+            vm->functions = functions;
+            vm->function_capacity = capacity;
+        }
+        vm->functions[vm->function_count++] = (VmFunction){node->text, 0, -1, 0, -1, 0};
+    }
+    if (info) info->vm_function = function;
+    return function;
+}
+
+static int compile_expression(Parser* p, VmProgram* vm, int node, int dest);
+
+// Evaluates node into some register and returns it: a local's own
+// register when node is just that local, otherwise a new one. -1 on error.
+static int compile_operand(Parser* p, VmProgram* vm, int node) {
+    const AstNode* n = &p->ast.nodes[node];
+    if (n->kind == NODE_NAME) {
+        int reg = find_local(vm, n->symbol);
+        if (reg >= 0) return reg;
+    }
+    int reg = new_register(p, vm, node);
+    if (reg < 0 || !compile_expression(p, vm, node, reg)) return -1;
+    return reg;
+}
+
+// A call: user functions take their arguments in consecutive registers,
+// which also hold the result. printf with a literal format gets its own
+// instruction, so the native backend can see the conversions.
+static int compile_call(Parser* p, VmProgram* vm, int node, int dest) {
+    const AstNode* n = &p->ast.nodes[node];
+    int first = n->first_child, format = -1;
+    if (first >= 0 && p->ast.nodes[first].kind == NODE_EXPRESSION) return vm_error(p, n->text, "cannot evaluate the arguments of");
+    if (first >= 0 && slice_equals(vm->source, n->text, "printf") && p->ast.nodes[first].kind == NODE_NAME &&
+        vm->source[p->ast.nodes[first].text.offset] == '"') {
+        format = add_string_literal(p, vm, p->ast.nodes[first].text);
+        if (format < 0) return 0;
+        first = p->ast.nodes[first].next_sibling;
+    }
+    int base = vm->next_register, count = 0;
+    for (int i = first; i >= 0; i = p->ast.nodes[i].next_sibling, count++) {
+        int reg = new_register(p, vm, i);
+        if (reg < 0 || !compile_expression(p, vm, i, reg)) return 0;
+    }
+    vm->next_register = base;
+    if (format >= 0) return emit_instruction(p, vm, OP_PRINTF, dest, base | count << 8, format) >= 0;
+    for (int builtin = 0; builtin < NUM_BUILTINS; builtin++) {
+        if (!slice_equals(vm->source, n->text, builtin_names[builtin])) continue;
+        if (count == 0 || (builtin != BUILTIN_PRINTF && count != 1)) return vm_error(p, n->text, "wrong number of arguments to");
+        return emit_instruction(p, vm, OP_BUILTIN, dest, base, builtin | count << 8) >= 0;
+    }
+    int function = find_function(p, vm, n);
+    if (function < 0) return 0;
+    VmFunction* f = &vm->functions[function];
+    if (f->num_params >= 0 && f->num_params != count) return vm_error(p, n->text, "wrong number of arguments to");
+    f->num_params = count;
+    return emit_instruction(p, vm, OP_CALL, dest, base, function) >= 0;
+}
+
+static OpCode binary_opcode(const char* op, int length) {
+    switch (op[0]) {
+    case '+': return OP_ADD;
+    case '-': return OP_SUB;
+    case '*': return OP_MUL;
+    case '/': return OP_DIV;
+    case '%': return OP_MOD;
+    case '<': return length == 2 ? OP_LE : OP_LT;
+    case '>': return length == 2 ? OP_GE : OP_GT;
+    case '=': return OP_EQ;
+    default: return OP_NE;
+    }
+}
+
+// Evaluates node into register dest. Returns 0 (after reporting it) if
+// the expression cannot be run.
+static int compile_expression(Parser* p, VmProgram* vm, int node, int dest) {
+    const AstNode* n = &p->ast.nodes[node];
+    const char* text = p->tokens.source + n->text.offset;
+    int value, saved = vm->next_register;
+    switch (n->kind) {
+    case NODE_CONSTANT:
+        return emit_instruction(p, vm, OP_LOADK, dest, 0, n->value) >= 0;
+    case NODE_NUMBER:
+        if (!parse_int_literal(text, n->text.length, &value)) return vm_error(p, n->text, "unsupported number");
+        return emit_instruction(p, vm, OP_LOADK, dest, 0, value) >= 0;
+    case NODE_NAME: {
+        if (text[0] == '"') {
+            int string = add_string_literal(p, vm, n->text);
+            return string >= 0 && emit_instruction(p, vm, OP_LOADS, dest, 0, string) >= 0;
+        }
+        int reg = find_local(vm, n->symbol);
+        if (reg >= 0) return emit_instruction(p, vm, OP_MOVE, dest, reg, 0) >= 0;
+        if (is_known_macro(p, n, &value)) return emit_instruction(p, vm, OP_LOADK, dest, 0, value) >= 0;
+        return vm_error(p, n->text, "unknown name");
+    }
+    case NODE_GROUP:
+        return compile_expression(p, vm, n->first_child, dest);
+    case NODE_UNARY: {
+        int operand = compile_operand(p, vm, n->first_child);
+        if (operand < 0) return 0;
+        OpCode op = text[0] == '+' ? OP_MOVE : text[0] == '-' ? OP_NEG : OP_NOT;
+        if (emit_instruction(p, vm, op, dest, operand, 0) < 0) return 0;
+        break;
+    }
+    case NODE_BINARY: {
+        int left = n->first_child, right = p->ast.nodes[left].next_sibling;
+        if (n->text.length == 2 && (text[0] == '&' || text[0] == '|')) {
+            // right is only evaluated if left does not decide. The value
+            // goes through a temporary since dest may be a local right reads.
+            int reg = new_register(p, vm, node);
+            if (reg < 0 || !compile_expression(p, vm, left, reg)) return 0;
+            int jump = emit_instruction(p, vm, text[0] == '&' ? OP_JZ : OP_JNZ, reg, 0, 0);
+            if (jump < 0 || !compile_expression(p, vm, right, reg)) return 0;
+            patch_jump(vm, jump);
+            if (emit_instruction(p, vm, OP_BOOL, dest, reg, 0) < 0) return 0;
+            break;
+        }
+        int a = compile_operand(p, vm, left);
+        int b = a < 0 ? -1 : compile_operand(p, vm, right);
+        if (b < 0) return 0;
+        if (emit_instruction(p, vm, binary_opcode(text, n->text.length), dest, a, b) < 0) return 0;
+        break;
+    }
+    case NODE_ASSIGN: {
+        int target = find_local(vm, p->ast.nodes[n->first_child].symbol);
+        if (target < 0) return vm_error(p, p->ast.nodes[n->first_child].text, "assignment to unknown name");
+        if (!compile_expression(p, vm, p->ast.nodes[n->first_child].next_sibling, target)) return 0;
+        if (dest != target && emit_instruction(p, vm, OP_MOVE, dest, target, 0) < 0) return 0;
+        break;
+    }
+    case NODE_CALL:
+        return compile_call(p, vm, node, dest);
+    default:
+        return vm_error(p, node_location(p, node), "cannot evaluate the expression at");
+    }
+    vm->next_register = saved;
+    return 1;
+}
+
+// Evaluates node for its effects only.
+static int compile_effect(Parser* p, VmProgram* vm, int node) {
+    int saved = vm->next_register;
+    int reg = new_register(p, vm, node);
+    int ok = reg >= 0 && compile_expression(p, vm, node, reg);
+    vm->next_register = saved;
+    return ok;
+}
+
+static int compile_statement(Parser* p, VmProgram* vm, int node);
+
+static int compile_block(Parser* p, VmProgram* vm, int block) {
+    int saved_locals = vm->local_count, saved_registers = vm->next_register;
+    for (int i = p->ast.nodes[block].first_child; i >= 0; i = p->ast.nodes[i].next_sibling) {
+        if (!compile_statement(p, vm, i)) return 0;
+    }
+    vm->local_count = saved_locals;
+    vm->next_register = saved_registers;
+    return 1;
+}
+
+// Emits a jump out of a loop or if when condition is false, or -1 (for an
+// empty for condition) if there is none.
+static int compile_condition(Parser* p, VmProgram* vm, int condition, int* jump) {
+    *jump = -1;
+    if (p->ast.nodes[condition].kind == NODE_EMPTY) return 1;
+    int saved = vm->next_register;
+    int reg = compile_operand(p, vm, condition);
+    vm->next_register = saved;
+    if (reg < 0) return 0;
+    *jump = emit_instruction(p, vm, OP_JZ, reg, 0, 0);
+    return *jump >= 0;
+}
+
+static int compile_statement(Parser* p, VmProgram* vm, int node) {
+    const AstNode* n = &p->ast.nodes[node];
+    int jump;
+    switch (n->kind) {
+    case NODE_DECL: {
+        int reg = new_register(p, vm, node);
+        if (reg < 0 || !compile_expression(p, vm, n->first_child, reg)) return 0;
+        return add_local(p, vm, n->symbol, reg);
+    }
+    case NODE_CALL:
+        return compile_effect(p, vm, node);
+    case NODE_STATEMENT:
+        return compile_effect(p, vm, n->first_child);
+    case NODE_RETURN: {
+        if (n->first_child < 0) return emit_instruction(p, vm, OP_RETURN0, 0, 0, 0) >= 0;
+        int saved = vm->next_register;
+        int reg = compile_operand(p, vm, n->first_child);
+        vm->next_register = saved;
+        if (reg < 0) return 0;
+        return emit_instruction(p, vm, OP_RETURN, reg, 0, 0) >= 0;
+    }
+    case NODE_BLOCK:
+        return compile_block(p, vm, node);
+    case NODE_IF: {
+        int then_block = p->ast.nodes[n->first_child].next_sibling;
+        int else_block = p->ast.nodes[then_block].next_sibling;
+        if (!compile_condition(p, vm, n->first_child, &jump) || !compile_block(p, vm, then_block)) return 0;
+        if (else_block >= 0) {
+            int skip_else = emit_instruction(p, vm, OP_JUMP, 0, 0, 0);
+            if (skip_else < 0) return 0;
+            patch_jump(vm, jump);
+            if (!compile_block(p, vm, else_block)) return 0;
+            patch_jump(vm, skip_else);
+        } else {
+            patch_jump(vm, jump);
+        }
+        return 1;
+    }
+    case NODE_WHILE: {
+        int top = vm->code_count;
+        if (!compile_condition(p, vm, n->first_child, &jump)) return 0;
+        if (!compile_block(p, vm, p->ast.nodes[n->first_child].next_sibling)) return 0;
+        if (emit_instruction(p, vm, OP_JUMP, 0, 0, top) < 0) return 0;
+        patch_jump(vm, jump);
+        return 1;
+    }
+    case NODE_FOR: {
+        int header = n->first_child;
+        if (p->ast.nodes[header].kind != NODE_FOR_HEADER) return vm_error(p, node_location(p, header), "cannot run the for loop at");
+        int init = p->ast.nodes[header].first_child;
+        int condition = p->ast.nodes[init].next_sibling;
+        int step = p->ast.nodes[condition].next_sibling;
+        if (p->ast.nodes[init].kind != NODE_EMPTY && !compile_effect(p, vm, init)) return 0;
+        int top = vm->code_count;
+        if (!compile_condition(p, vm, condition, &jump)) return 0;
+        if (!compile_block(p, vm, p->ast.nodes[header].next_sibling)) return 0;
+        if (p->ast.nodes[step].kind != NODE_EMPTY && !compile_effect(p, vm, step)) return 0;
+        if (emit_instruction(p, vm, OP_JUMP, 0, 0, top) < 0) return 0;
+        if (jump >= 0) patch_jump(vm, jump);
+        return 1;
+    }
+    default:
+        return vm_error(p, node_location(p, node), "cannot run the statement at");
+    }
+}
+
+// Compiles the function at the root of the tree (directives have already
+// been applied by folding). Returns 0 after reporting an error.
+static int compile_declaration(Parser* p) {
+    VmProgram* vm = p->vm;
+    const AstNode* root = &p->ast.nodes[0];
+    if (root->kind != NODE_FUNCTION) return 1;
+    int function = find_function(p, vm, root);
+    if (function < 0) return 0;
+    VmFunction* f = &vm->functions[function];
+    if (f->defined) return vm_error(p, root->text, "redefinition of");
+
+    vm->local_count = 0;
+    vm->next_register = 0;
+    vm->max_registers = 0;
+    int child = root->first_child, num_params = 0;
+    int int_signature = slice_equals(vm->source, root->type, "int");
+    for (; p->ast.nodes[child].kind == NODE_PARAM; child = p->ast.nodes[child].next_sibling, num_params++) {
+        if (num_params == VM_MAX_REGISTERS) return vm_error(p, root->text, "too many parameters in");
+        if (!add_local(p, vm, p->ast.nodes[child].symbol, new_register(p, vm, child))) return 0;
+        int_signature = int_signature && slice_equals(vm->source, p->ast.nodes[child].type, "int");
+    }
+    if (f->num_params >= 0 && f->num_params != num_params) return vm_error(p, root->text, "wrong number of arguments to");
+    f->num_params = num_params;
+    int entry = vm->code_count;
+    if (!compile_block(p, vm, child) || emit_instruction(p, vm, OP_RETURN0, 0, 0, 0) < 0) return 0;
+
+    vm->functions[function] = (VmFunction){root->text, 1, num_params, vm->max_registers, entry,
+                                           int_signature && num_params <= VM_MAX_PROMOTED_PARAMS};
+    return 1;
+}
+
+// From here on the code runs programs and drives the command line. The
+// library build (-DYODA_NO_MAIN) stops here and exports only yoda.h.
+#ifndef YODA_NO_MAIN
+
+static void free_vm_program(VmProgram* vm) {
+    free(vm->code);
+    free(vm->strings);
+    free(vm->functions);
+    free(vm->locals);
+}
+
+// Parses source and compiles it into vm. Returns the index of main, or -1
+// after reporting why the program cannot run.
+static int compile_program(VmProgram* vm, const char* source, size_t length) {
+    *vm = (VmProgram){.source = source};
+    Lexer lexer;
+    init_lexer(&lexer, source, length);
+    Parser p = {.tokens = {.source = source}, .lexer = &lexer, .vm = vm};
+    char* output = parse_program(&p, INT_MAX);
+    release_token_stream(&p);
+    if (!output) return -1;
+    free(output);
+
+    int main_function = -1;
+    for (int i = 0; i < vm->function_count; i++) {
+        const VmFunction* f = &vm->functions[i];
+        Slice name = f->name;
+        if (!f->defined) {
+            printf("VM Error: call to undefined function '%.*s'\n", name.length, source + name.offset);
+            return -1;
+        }
+        if (slice_equals(source, name, "main")) main_function = i;
+    }
+    if (main_function < 0) printf("VM Error: no main function\n");
+    else if (vm->functions[main_function].num_params != 0) printf("VM Error: main cannot take parameters\n");
+    else return main_function;
+    return -1;
+}
+
+// printf for the VM: the text between conversions is copied and each
+// conversion is handed to the C library with its argument, as an int
+// unless it is %s. Length modifiers are dropped since every value is an
+// int; a string argument that is not a literal prints as "(invalid)".
+static int vm_printf(const VmProgram* vm, const char* format, const int64_t* args, int count) {
+    int written = 0, next = 0;
+    const char* s = format;
+    while (*s) {
+        if (*s != '%' || s[1] == '%') {
+            const char* run = *s == '%' ? s + 1 : s;
+            const char* end = *s == '%' ? s + 2 : strchr(s, '%');
+            if (!end) end = s + strlen(s);
+            fwrite(run, 1, end - run, stdout);
+            written += end - run;
+            s = end;
+            continue;
+        }
+        char spec[32];
+        int spec_length = 0;
+        const char* start = s++;
+        while (*s && strchr("-+ #0123456789.", *s) && spec_length < 24) spec[spec_length++] = *s++;
+        while (*s && strchr("hlLqjzt", *s)) s++;
+        char conversion = *s;
+        if (!conversion) break;
+        s++;
+        int64_t arg = next < count ? args[next++] : 0;
+        char format_spec[32] = "%";
+        memcpy(format_spec + 1, spec, spec_length);
+        format_spec[spec_length + 1] = conversion;
+        format_spec[spec_length + 2] = '\0';
+        if (conversion == 's') {
+            const char* str = (const char*)(intptr_t)arg;
+            if (str < vm->strings || str >= vm->strings + vm->strings_size) str = "(invalid)";
+            written += printf(format_spec, str);
+        } else if (strchr("dicouxX", conversion)) {
+            written += printf(format_spec, (int)arg);
+        } else {
+            fwrite(start, 1, s - start, stdout);
+            written += s - start;
+        }
+    }
+    return written;
+}
+
+static int64_t call_builtin(const VmProgram* vm, int builtin, const int64_t* args, int count) {
+    const char* str = (const char*)(intptr_t)args[0];
+    int is_string = str >= vm->strings && str < vm->strings + vm->strings_size;
+    switch (builtin) {
+    case BUILTIN_PRINTF: return is_string ? vm_printf(vm, str, args + 1, count - 1) : 0;
+    case BUILTIN_PUTS: return puts(is_string ? str : "(invalid)");
+    default: return putchar((int)args[0]);
+    }
+}
+
+typedef struct {
+    const Instruction* return_to;
+    int base;    // the caller's
+    int result;  // caller register that receives the return value
+} VmFrame;
+
+#define VM_INT(x) ((int64_t)(int32_t)(uint32_t)(x))
+
+// Compiled code that calls can switch to ("run --tiered"). entries[f] is
+// function f's, or NULL to keep it in the VM.
+typedef struct {
+    atomic_int ready;    // set once entries may be read
+    void** entries;
+} PromotedCode;
+
+static int call_promoted(void* entry, const int64_t* args, int count) {
+    int a[VM_MAX_PROMOTED_PARAMS] = {0};
+    for (int i = 0; i < count; i++) a[i] = (int)args[i];
+    switch (count) {
+    case 0: return ((int (*)(void))entry)();
+    case 1: return ((int (*)(int))entry)(a[0]);
+    case 2: return ((int (*)(int, int))entry)(a[0], a[1]);
+    case 3: return ((int (*)(int, int, int))entry)(a[0], a[1], a[2]);
+    case 4: return ((int (*)(int, int, int, int))entry)(a[0], a[1], a[2], a[3]);
+    case 5: return ((int (*)(int, int, int, int, int))entry)(a[0], a[1], a[2], a[3], a[4]);
+    default: return ((int (*)(int, int, int, int, int, int))entry)(a[0], a[1], a[2], a[3], a[4], a[5]);
+    }
+}
+
+// Runs function until it returns. Returns 1 and sets *result, or 0 after
+// reporting a runtime error. promoted may be NULL.
+static int run_vm(const VmProgram* vm, int function, const PromotedCode* promoted, int* result) {
+    static const char* const runtime_errors[] = {NULL, "division by zero", "call stack overflow", "out of memory"};
+    int register_capacity = 1024;
+    int64_t* registers = malloc(register_capacity * sizeof(int64_t));
+    int frame_capacity = 64, depth = 0, error = 0, base = 0;
+    VmFrame* frames = malloc(frame_capacity * sizeof(VmFrame));
+    if (!registers || !frames) {
+        error = 3;
+        goto done;
+    }
+    const Instruction* code = vm->code;
+    const Instruction* ip = code + vm->functions[function].entry;
+    int64_t* r = registers;
+    int64_t value = 0;
+
+#if defined(__GNUC__)
+    // Computed goto: every handler jumps straight to the next one.
+    static void* const dispatch[NUM_OPCODES] = {
+#define VM_OPCODE_LABEL(name) &&do_##name,
+        VM_OPCODES(VM_OPCODE_LABEL)
+#undef VM_OPCODE_LABEL
+    };
+#define VM_CASE(name) do_##name:
+#define VM_NEXT() goto *dispatch[ip->op]
+#else
+#define VM_CASE(name) case OP_##name:
+#define VM_NEXT() goto dispatch_op
+#endif
+#define VM_BINARY(name, expression) \
+    VM_CASE(name) { int64_t x = r[ip->b], y = r[ip->c]; (void)x; (void)y; r[ip->a] = (expression); ip++; VM_NEXT(); }
+
+    VM_NEXT();
+#if !defined(__GNUC__)
+dispatch_op:
+    switch (ip->op) {
+#endif
+    VM_CASE(LOADK) r[ip->a] = ip->c; ip++; VM_NEXT();
+    VM_CASE(LOADS) r[ip->a] = (int64_t)(intptr_t)(vm->strings + ip->c); ip++; VM_NEXT();
+    VM_CASE(MOVE) r[ip->a] = r[ip->b]; ip++; VM_NEXT();
+    VM_BINARY(ADD, VM_INT((uint64_t)x + (uint64_t)y))
+    VM_BINARY(SUB, VM_INT((uint64_t)x - (uint64_t)y))
+    VM_BINARY(MUL, VM_INT((uint64_t)x * (uint64_t)y))
+    VM_CASE(DIV)
+    VM_CASE(MOD) {
+        int64_t x = (int32_t)r[ip->b], y = (int32_t)r[ip->c];
+        if (y == 0) { error = 1; goto done; }
+        r[ip->a] = VM_INT(ip->op == OP_DIV ? x / y : x % y);
+        ip++;
+        VM_NEXT();
+    }
+    VM_BINARY(LT, x < y)
+    VM_BINARY(LE, x <= y)
+    VM_BINARY(GT, x > y)
+    VM_BINARY(GE, x >= y)
+    VM_BINARY(EQ, x == y)
+    VM_BINARY(NE, x != y)
+    VM_CASE(NEG) r[ip->a] = VM_INT(-(uint64_t)r[ip->b]); ip++; VM_NEXT();
+    VM_CASE(NOT) r[ip->a] = !r[ip->b]; ip++; VM_NEXT();
+    VM_CASE(BOOL) r[ip->a] = r[ip->b] != 0; ip++; VM_NEXT();
+    VM_CASE(JUMP) ip = code + ip->c; VM_NEXT();
+    VM_CASE(JZ) ip = r[ip->a] ? ip + 1 : code + ip->c; VM_NEXT();
+    VM_CASE(JNZ) ip = r[ip->a] ? code + ip->c : ip + 1; VM_NEXT();
+    VM_CASE(CALL) {
+        const VmFunction* callee = &vm->functions[ip->c];
+        if (promoted && atomic_load_explicit(&promoted->ready, memory_order_acquire) && promoted->entries[ip->c]) {
+            r[ip->a] = call_promoted(promoted->entries[ip->c], r + ip->b, callee->num_params);
+            ip++;
+            VM_NEXT();
+        }
+        if (depth == VM_MAX_CALL_DEPTH) { error = 2; goto done; }
+        if (depth == frame_capacity) {
+            VmFrame* grown = realloc(frames, frame_capacity * 2 * sizeof(VmFrame));
+            if (!grown) { error = 3; goto done; }
+            frames = grown;
+            frame_capacity *= 2;
+        }
+        frames[depth++] = (VmFrame){ip + 1, base, ip->a};
+        base += ip->b;
+        if (base + callee->num_registers > register_capacity) {
+            int capacity = register_capacity;
+            while (base + callee->num_registers > capacity) capacity *= 2;
+            int64_t* grown = realloc(registers, capacity * sizeof(int64_t));
+            if (!grown) { error = 3; goto done; }
+            registers = grown;
+            register_capacity = capacity;
+        }
+        r = registers + base;
+        ip = code + callee->entry;
+        VM_NEXT();
+    }
+    VM_CASE(BUILTIN)
+        r[ip->a] = call_builtin(vm, ip->c & 0xFF, r + ip->b, ip->c >> 8);
+        ip++;
+        VM_NEXT();
+    VM_CASE(PRINTF)
+        r[ip->a] = vm_printf(vm, vm->strings + ip->c, r + (ip->b & 0xFF), ip->b >> 8);
+        ip++;
+        VM_NEXT();
+    VM_CASE(RETURN)
+    VM_CASE(RETURN0) {
+        value = ip->op == OP_RETURN ? r[ip->a] : 0;
+        if (depth == 0) goto done;
+        VmFrame frame = frames[--depth];
+        base = frame.base;
+        r = registers + base;
+        r[frame.result] = value;
+        ip = frame.return_to;
+        VM_NEXT();
+    }
+#if !defined(__GNUC__)
+    }
+#endif
+#undef VM_BINARY
+#undef VM_NEXT
+#undef VM_CASE
+
+done:
+    free(registers);
+    free(frames);
+    if (error) {
+        fflush(stdout);
+        printf("VM Error: %s\n", runtime_errors[error]);
+        return 0;
+    }
+    *result = (int)value;
+    return 1;
+}
+
+// --- Native Backend ---
+
+// --native lowers the VM's bytecode to x86-64 and writes a static Linux
+// executable itself, so neither a C compiler nor libc is involved. Each VM
+// register becomes a 64-bit stack slot below rbp. Callers push arguments
+// right to left and the callee copies them into its first slots. Output
+// goes through a buffer flushed with write(2). printf with a literal format
+// is expanded at compile time into calls of a few runtime routines, so it
+// supports only %d %i %u %c %s and %%.
+#define NATIVE_BASE 0x400000      // headers, string literals and code
+#define NATIVE_BUFFER_SIZE 4096
+#define NATIVE_HEADERS_SIZE (64 + 3 * 56)
+
+// Offsets in the writable segment, which starts at the first page after the
+// code: the buffered length (8 bytes), then the buffer.
+#define NATIVE_BSS_LENGTH 0
+#define NATIVE_BSS_BUFFER 16
+#define NATIVE_BSS_SIZE (16 + NATIVE_BUFFER_SIZE)
+// Runtime data after the string literals.
+static const char native_data[] = "(invalid)\nError: division by zero\n";
+#define NATIVE_INVALID 0
+#define NATIVE_NEWLINE 9
+#define NATIVE_DIV_MESSAGE 10
+
+enum { RT_START, RT_FLUSH, RT_WRITE, RT_PRINT_INT, RT_PRINT_STR, RT_PUT_CHAR, RT_DIV_ERROR, NUM_RUNTIME };
+
+typedef struct {
+    int at;      // offset of a rel32 operand, or of an absolute address
+    int label;   // -1 for an address in the writable segment
+} NativeFixup;
+
+typedef struct {
+    uint8_t* code;
+    int size;
+    int capacity;
+    int* labels;       // code offset of each label, -1 until placed
+    int label_count;
+    int label_capacity;
+    NativeFixup* fixups;
+    int fixup_count;
+    int fixup_capacity;
+    uint32_t strings_address;
+    uint32_t data_address;
+    int runtime;       // label of the first runtime routine
+    int out_of_memory; // a buffer could not grow; everything after is dropped
+} NativeCode;
+
+static void emit_code(NativeCode* nc, const char* bytes, int count) {
+    if (nc->out_of_memory) return;
+    if (nc->size + count > nc->capacity) {
+        uint8_t* code = realloc(nc->code, (nc->size + count) * 2);
+        if (!code) {
+            nc->out_of_memory = 1;
+            return;
+        }
+        nc->code = code;
+        nc->capacity = (nc->size + count) * 2;
+    }
+    memcpy(nc->code + nc->size, bytes, count);
+    nc->size += count;
+}
+
+#define EMIT(nc, bytes) emit_code(nc, bytes, sizeof(bytes) - 1)
+
+static void emit_u32(NativeCode* nc, uint32_t value) {
+    char bytes[4] = {value, value >> 8, value >> 16, value >> 24};
+    emit_code(nc, bytes, 4);
+}
+
+static int new_label(NativeCode* nc) {
+    if (nc->out_of_memory) return 0;
+    if (nc->label_count == nc->label_capacity) {
+        int capacity = nc->label_capacity == 0 ? 64 : nc->label_capacity * 2;
+        int* labels = realloc(nc->labels, capacity * sizeof(int));
+        if (!labels) {
+            nc->out_of_memory = 1;
+            return 0;
+        }
+        nc->labels = labels;
+        nc->label_capacity = capacity;
+    }
+    nc->labels[nc->label_count] = -1;
+    return nc->label_count++;
+}
+
+static void place_label(NativeCode* nc, int label) {
+    if (!nc->out_of_memory) nc->labels[label] = nc->size;
+}
+
+// Emits a 32-bit operand (value) that is patched once everything is placed.
+static void emit_fixup(NativeCode* nc, int label, uint32_t value) {
+    if (nc->out_of_memory) return;
+    if (nc->fixup_count == nc->fixup_capacity) {
+        int capacity = nc->fixup_capacity == 0 ? 64 : nc->fixup_capacity * 2;
+        NativeFixup* fixups = realloc(nc->fixups, capacity * sizeof(NativeFixup));
+        if (!fixups) {
+            nc->out_of_memory = 1;
+            return;
+        }
+        nc->fixups = fixups;
+        nc->fixup_capacity = capacity;
+    }
+    nc->fixups[nc->fixup_count++] = (NativeFixup){nc->size, label};
+    emit_u32(nc, value);
+}
+
+// Emits opcode and a rel32 to label.
+static void emit_branch(NativeCode* nc, const char* opcode, int length, int label) {
+    emit_code(nc, opcode, length);
+    emit_fixup(nc, label, 0);
+}
+
+#define EMIT_BRANCH(nc, opcode, label) emit_branch(nc, opcode, sizeof(opcode) - 1, label)
+#define EMIT_CALL(nc, routine) EMIT_BRANCH(nc, "\xE8", (nc)->runtime + (routine))
+
+// Emits opcode with register reg's slot, [rbp - 8 * (reg + 1)], as operand.
+#define EMIT_SLOT(nc, opcode, reg) (EMIT(nc, opcode), emit_u32(nc, (uint32_t)(-8 * ((reg) + 1))))
+
+// mov esi, address; mov edx, length; call write
+static void emit_write(NativeCode* nc, uint32_t address, int length) {
+    EMIT(nc, "\xBE");
+    emit_u32(nc, address);
+    EMIT(nc, "\xBA");
+    emit_u32(nc, length);
+    EMIT_CALL(nc, RT_WRITE);
+}
+
+// Expands printf(format, r[base], ...) into runtime calls, summing the
+// bytes written in r12.
+static int translate_printf(const VmProgram* vm, NativeCode* nc, const Instruction* ip) {
+    const char* format = vm->strings + ip->c;
+    int base = ip->b & 0xFF, count = ip->b >> 8, next = 0;
+    EMIT(nc, "\x45\x31\xE4");                               // xor r12d, r12d
+    for (const char* s = format; *s;) {
+        if (*s != '%' || s[1] == '%') {
+            const char* run = *s == '%' ? s + 1 : s;
+            const char* end = *s == '%' ? s + 2 : strchr(s, '%');
+            if (!end) end = s + strlen(s);
+            emit_write(nc, nc->strings_address + (run - vm->strings), end - run);
+            s = end;
+        } else {
+            char conversion = s[1];
+            if (!conversion) break;
+            if (!strchr("diucs", conversion)) {
+                int length = 2;
+                while (s[length - 1] && !isalpha((unsigned char)s[length - 1])) length++;
+                printf("Native Error: unsupported printf conversion '%.*s'\n", length, s);
+                return 0;
+            }
+            s += 2;
+            int arg = next < count ? base + next++ : -1;
+            if (arg < 0) {
+                EMIT(nc, "\x31\xC0\x31\xF6");                   // xor eax, eax; xor esi, esi
+            } else if (conversion == 's') {
+                EMIT_SLOT(nc, "\x48\x8B\xB5", arg);            // mov rsi, [slot]
+            } else if (conversion == 'u') {
+                EMIT_SLOT(nc, "\x8B\x85", arg);                // mov eax, [slot]
+            } else {
+                EMIT_SLOT(nc, "\x48\x63\x85", arg);            // movsxd rax, [slot]
+            }
+            if (conversion == 's') {
+                EMIT_CALL(nc, RT_PRINT_STR);
+            } else if (conversion == 'c') {
+                EMIT_CALL(nc, RT_PUT_CHAR);
+                EMIT(nc, "\xB8\x01\x00\x00\x00");              // mov eax, 1
+            } else {
+                EMIT_CALL(nc, RT_PRINT_INT);
+            }
+        }
+        EMIT(nc, "\x49\x01\xC4");                             // add r12, rax
+    }
+    EMIT_SLOT(nc, "\x4C\x89\xA5", ip->a);                     // mov [slot], r12
+    return 1;
+}
+
+// Translates one instruction. Values are kept sign-extended from 32 bits
+// like the VM's, so the arithmetic is done on the low halves.
+static int translate_instruction(const VmProgram* vm, NativeCode* nc, const Instruction* ip) {
+    static const char setcc[][3] = {"\x0F\x9C\xC0", "\x0F\x9E\xC0", "\x0F\x9F\xC0",
+                                    "\x0F\x9D\xC0", "\x0F\x94\xC0", "\x0F\x95\xC0"};
+    switch (ip->op) {
+    case OP_LOADK:
+    case OP_LOADS:
+        EMIT_SLOT(nc, "\x48\xC7\x85", ip->a);                  // mov qword [slot], imm32
+        emit_u32(nc, ip->op == OP_LOADK ? (uint32_t)ip->c : nc->strings_address + ip->c);
+        break;
+    case OP_MOVE:
+        EMIT_SLOT(nc, "\x48\x8B\x85", ip->b);                  // mov rax, [slot]
+        EMIT_SLOT(nc, "\x48\x89\x85", ip->a);                  // mov [slot], rax
+        break;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+        EMIT_SLOT(nc, "\x8B\x85", ip->b);                      // mov eax, [slot]
+        EMIT_SLOT(nc, "\x8B\x8D", ip->c);                      // mov ecx, [slot]
+        if (ip->op == OP_ADD) EMIT(nc, "\x01\xC8");            // add eax, ecx
+        else if (ip->op == OP_SUB) EMIT(nc, "\x29\xC8");       // sub eax, ecx
+        else EMIT(nc, "\x0F\xAF\xC1");                         // imul eax, ecx
+        EMIT(nc, "\x48\x63\xC0");                              // movsxd rax, eax
+        EMIT_SLOT(nc, "\x48\x89\x85", ip->a);
+        break;
+    case OP_DIV:
+    case OP_MOD: {
+        // idiv traps on INT_MIN / -1, which the VM wraps, so -1 is done apart.
+        int normal = new_label(nc), done = new_label(nc);
+        EMIT_SLOT(nc, "\x8B\x85", ip->b);                      // mov eax, [slot]
+        EMIT_SLOT(nc, "\x8B\x8D", ip->c);                      // mov ecx, [slot]
+        EMIT(nc, "\x85\xC9");                                  // test ecx, ecx
+        EMIT_BRANCH(nc, "\x0F\x84", nc->runtime + RT_DIV_ERROR);  // jz
+        EMIT(nc, "\x83\xF9\xFF");                              // cmp ecx, -1
+        EMIT_BRANCH(nc, "\x0F\x85", normal);                   // jne
+        if (ip->op == OP_DIV) EMIT(nc, "\xF7\xD8");            // neg eax
+        else EMIT(nc, "\x31\xC0");                             // xor eax, eax
+        EMIT_BRANCH(nc, "\xE9", done);
+        place_label(nc, normal);
+        EMIT(nc, "\x99\xF7\xF9");                              // cdq; idiv ecx
+        if (ip->op == OP_MOD) EMIT(nc, "\x89\xD0");            // mov eax, edx
+        place_label(nc, done);
+        EMIT(nc, "\x48\x63\xC0");                              // movsxd rax, eax
+        EMIT_SLOT(nc, "\x48\x89\x85", ip->a);
+        break;
+    }
+    case OP_LT: case OP_LE: case OP_GT: case OP_GE: case OP_EQ: case OP_NE:
+        EMIT_SLOT(nc, "\x48\x8B\x85", ip->b);                  // mov rax, [slot]
+        EMIT_SLOT(nc, "\x48\x3B\x85", ip->c);                  // cmp rax, [slot]
+        emit_code(nc, setcc[ip->op - OP_LT], 3);               // setcc al
+        EMIT(nc, "\x0F\xB6\xC0");                              // movzx eax, al
+        EMIT_SLOT(nc, "\x48\x89\x85", ip->a);
+        break;
+    case OP_NEG:
+        EMIT_SLOT(nc, "\x8B\x85", ip->b);                      // mov eax, [slot]
+        EMIT(nc, "\xF7\xD8\x48\x63\xC0");                      // neg eax; movsxd rax, eax
+        EMIT_SLOT(nc, "\x48\x89\x85", ip->a);
+        break;
+    case OP_NOT:
+    case OP_BOOL:
+        EMIT_SLOT(nc, "\x48\x8B\x85", ip->b);                  // mov rax, [slot]
+        EMIT(nc, "\x48\x85\xC0");                              // test rax, rax
+        if (ip->op == OP_NOT) EMIT(nc, "\x0F\x94\xC0");        // sete al
+        else EMIT(nc, "\x0F\x95\xC0");                         // setne al
+        EMIT(nc, "\x0F\xB6\xC0");                              // movzx eax, al
+        EMIT_SLOT(nc, "\x48\x89\x85", ip->a);
+        break;
+    case OP_JUMP:
+        EMIT_BRANCH(nc, "\xE9", ip->c);
+        break;
+    case OP_JZ:
+    case OP_JNZ:
+        EMIT_SLOT(nc, "\x48\x8B\x85", ip->a);                  // mov rax, [slot]
+        EMIT(nc, "\x48\x85\xC0");                              // test rax, rax
+        if (ip->op == OP_JZ) EMIT_BRANCH(nc, "\x0F\x84", ip->c);
+        else EMIT_BRANCH(nc, "\x0F\x85", ip->c);
+        break;
+    case OP_CALL: {
+        int num_params = vm->functions[ip->c].num_params;
+        for (int i = num_params - 1; i >= 0; i--) EMIT_SLOT(nc, "\xFF\xB5", ip->b + i);  // push [slot]
+        EMIT_BRANCH(nc, "\xE8", vm->code_count + ip->c);
+        if (num_params > 0) {
+            EMIT(nc, "\x48\x81\xC4");                          // add rsp, imm32
+            emit_u32(nc, 8 * num_params);
+        }
+        EMIT_SLOT(nc, "\x48\x89\x85", ip->a);
+        break;
+    }
+    case OP_BUILTIN:
+        if ((ip->c & 0xFF) == BUILTIN_PRINTF) {
+            printf("Native Error: printf needs a literal format string\n");
+            return 0;
+        }
+        if ((ip->c & 0xFF) == BUILTIN_PUTS) {
+            EMIT_SLOT(nc, "\x48\x8B\xB5", ip->b);              // mov rsi, [slot]
+            EMIT_CALL(nc, RT_PRINT_STR);
+            EMIT(nc, "\x49\x89\xC4");                          // mov r12, rax
+            emit_write(nc, nc->data_address + NATIVE_NEWLINE, 1);
+            EMIT(nc, "\x49\x8D\x44\x24\x01");                  // lea rax, [r12 + 1]
+        } else {
+            EMIT_SLOT(nc, "\x48\x8B\x85", ip->b);              // mov rax, [slot]
+            EMIT_CALL(nc, RT_PUT_CHAR);
+        }
+        EMIT_SLOT(nc, "\x48\x89\x85", ip->a);
+        break;
+    case OP_PRINTF:
+        return translate_printf(vm, nc, ip);
+    case OP_RETURN:
+        EMIT_SLOT(nc, "\x48\x8B\x85", ip->a);                  // mov rax, [slot]
+        EMIT(nc, "\xC9\xC3");                                  // leave; ret
+        break;
+    case OP_RETURN0:
+        EMIT(nc, "\x31\xC0\xC9\xC3");                          // xor eax, eax; leave; ret
+        break;
+    }
+    return 1;
+}
+
+// The address of offset in the writable segment, which is only known once
+// the code has its final size.
+#define EMIT_BSS_ADDRESS(nc, offset) emit_fixup(nc, -1, offset)
+
+// Absolute 32-bit address operand: SIB byte without base or index.
+#define EMIT_ABSOLUTE(nc, opcode, offset) (EMIT(nc, opcode), EMIT_BSS_ADDRESS(nc, offset))
+
+// The entry point and the routines compiled code calls. write takes the
+// bytes in rsi and rdx, print_int a value in rax, print_str a pointer in
+// rsi and put_char a byte in rax. Each returns the number of bytes written
+// (put_char returns the byte) and leaves r12 alone.
+static void emit_runtime(NativeCode* nc, int main_label) {
+    int rt = nc->runtime, label;
+
+    place_label(nc, rt + RT_START);
+    EMIT_BRANCH(nc, "\xE8", main_label);
+    EMIT(nc, "\x49\x89\xC4");                                  // mov r12, rax
+    EMIT_CALL(nc, RT_FLUSH);
+    EMIT(nc, "\x4C\x89\xE7\xB8\x3C\x00\x00\x00\x0F\x05");      // mov rdi, r12; mov eax, 60 (exit); syscall
+
+    place_label(nc, rt + RT_FLUSH);
+    label = new_label(nc);
+    EMIT_ABSOLUTE(nc, "\x48\x8B\x14\x25", NATIVE_BSS_LENGTH);     // mov rdx, [length]
+    EMIT(nc, "\x48\x85\xD2");                                  // test rdx, rdx
+    EMIT_BRANCH(nc, "\x0F\x84", label);                        // jz
+    EMIT(nc, "\xB8\x01\x00\x00\x00\xBF\x01\x00\x00\x00");      // mov eax, 1 (write); mov edi, 1
+    EMIT(nc, "\xBE");                                          // mov esi, buffer
+    EMIT_BSS_ADDRESS(nc, NATIVE_BSS_BUFFER);
+    EMIT(nc, "\x0F\x05");                                      // syscall
+    EMIT_ABSOLUTE(nc, "\x48\xC7\x04\x25", NATIVE_BSS_LENGTH);     // mov qword [length], 0
+    emit_u32(nc, 0);
+    place_label(nc, label);
+    EMIT(nc, "\xC3");
+
+    // Copies into the buffer, flushing first if it would overflow; what is
+    // bigger than the buffer is written directly.
+    place_label(nc, rt + RT_WRITE);
+    int copy = new_label(nc), done = new_label(nc);
+    EMIT(nc, "\x52");                                          // push rdx
+    EMIT_ABSOLUTE(nc, "\x48\x8B\x04\x25", NATIVE_BSS_LENGTH);     // mov rax, [length]
+    EMIT(nc, "\x48\x01\xD0\x48\x3D");                          // add rax, rdx; cmp rax, imm32
+    emit_u32(nc, NATIVE_BUFFER_SIZE);
+    EMIT_BRANCH(nc, "\x0F\x86", copy);                         // jbe
+    EMIT(nc, "\x56\x52");                                      // push rsi; push rdx
+    EMIT_CALL(nc, RT_FLUSH);
+    EMIT(nc, "\x5A\x5E\x48\x81\xFA");                          // pop rdx; pop rsi; cmp rdx, imm32
+    emit_u32(nc, NATIVE_BUFFER_SIZE);
+    EMIT_BRANCH(nc, "\x0F\x86", copy);                         // jbe
+    EMIT(nc, "\xB8\x01\x00\x00\x00\xBF\x01\x00\x00\x00\x0F\x05");  // write(1, rsi, rdx)
+    EMIT_BRANCH(nc, "\xE9", done);
+    place_label(nc, copy);
+    EMIT_ABSOLUTE(nc, "\x48\x8B\x3C\x25", NATIVE_BSS_LENGTH);     // mov rdi, [length]
+    EMIT_ABSOLUTE(nc, "\x48\x01\x14\x25", NATIVE_BSS_LENGTH);     // add [length], rdx
+    EMIT(nc, "\x48\x81\xC7");                                  // add rdi, buffer
+    EMIT_BSS_ADDRESS(nc, NATIVE_BSS_BUFFER);
+    EMIT(nc, "\x48\x89\xD1\xF3\xA4");                          // mov rcx, rdx; rep movsb
+    place_label(nc, done);
+    EMIT(nc, "\x58\xC3");                                      // pop rax; ret
+
+    // Converts digits backwards into a buffer below rbp.
+    place_label(nc, rt + RT_PRINT_INT);
+    int positive = new_label(nc), digit = new_label(nc), write = new_label(nc);
+    EMIT(nc, "\x55\x48\x89\xE5\x48\x83\xEC\x20");              // push rbp; mov rbp, rsp; sub rsp, 32
+    EMIT(nc, "\x49\x89\xC1\x48\x85\xC0");                      // mov r9, rax; test rax, rax
+    EMIT_BRANCH(nc, "\x0F\x89", positive);                     // jns
+    EMIT(nc, "\x48\xF7\xD8");                                  // neg rax
+    place_label(nc, positive);
+    EMIT(nc, "\x48\x89\xEE\xB9\x0A\x00\x00\x00");              // mov rsi, rbp; mov ecx, 10
+    place_label(nc, digit);
+    EMIT(nc, "\x31\xD2\x48\xF7\xF1");                          // xor edx, edx; div rcx
+    EMIT(nc, "\x80\xC2\x30\x48\xFF\xCE\x88\x16");              // add dl, '0'; dec rsi; mov [rsi], dl
+    EMIT(nc, "\x48\x85\xC0");                                  // test rax, rax
+    EMIT_BRANCH(nc, "\x0F\x85", digit);                        // jnz
+    EMIT(nc, "\x4D\x85\xC9");                                  // test r9, r9
+    EMIT_BRANCH(nc, "\x0F\x89", write);                        // jns
+    EMIT(nc, "\x48\xFF\xCE\xC6\x06\x2D");                      // dec rsi; mov byte [rsi], '-'
+    place_label(nc, write);
+    EMIT(nc, "\x48\x89\xEA\x48\x29\xF2");                      // mov rdx, rbp; sub rdx, rsi
+    EMIT_CALL(nc, RT_WRITE);
+    EMIT(nc, "\xC9\xC3");                                      // leave; ret
+
+    // Like the VM, prints "(invalid)" for a pointer outside the literals.
+    place_label(nc, rt + RT_PRINT_STR);
+    int invalid = new_label(nc), measure = new_label(nc), measured = new_label(nc);
+    EMIT(nc, "\xB8");                                          // mov eax, strings
+    emit_u32(nc, nc->strings_address);
+    EMIT(nc, "\x48\x39\xC6");                                  // cmp rsi, rax
+    EMIT_BRANCH(nc, "\x0F\x82", invalid);                      // jb
+    EMIT(nc, "\xB8");                                          // mov eax, end of strings
+    emit_u32(nc, nc->data_address);
+    EMIT(nc, "\x48\x39\xC6");                                  // cmp rsi, rax
+    EMIT_BRANCH(nc, "\x0F\x83", invalid);                      // jae
+    EMIT(nc, "\x31\xD2");                                      // xor edx, edx
+    place_label(nc, measure);
+    EMIT(nc, "\x80\x3C\x16\x00");                              // cmp byte [rsi + rdx], 0
+    EMIT_BRANCH(nc, "\x0F\x84", measured);                     // je
+    EMIT(nc, "\x48\xFF\xC2");                                  // inc rdx
+    EMIT_BRANCH(nc, "\xE9", measure);
+    place_label(nc, measured);
+    EMIT_BRANCH(nc, "\xE9", rt + RT_WRITE);
+    place_label(nc, invalid);
+    emit_write(nc, nc->data_address + NATIVE_INVALID, 9);
+    EMIT(nc, "\xC3");
+
+    place_label(nc, rt + RT_PUT_CHAR);
+    EMIT(nc, "\x50\x48\x89\xE6\xBA\x01\x00\x00\x00");          // push rax; mov rsi, rsp; mov edx, 1
+    EMIT_CALL(nc, RT_WRITE);
+    EMIT(nc, "\x58\x0F\xB6\xC0\xC3");                          // pop rax; movzx eax, al; ret
+
+    place_label(nc, rt + RT_DIV_ERROR);
+    EMIT_CALL(nc, RT_FLUSH);
+    emit_write(nc, nc->data_address + NATIVE_DIV_MESSAGE, sizeof(native_data) - 1 - NATIVE_DIV_MESSAGE);
+    EMIT_CALL(nc, RT_FLUSH);
+    EMIT(nc, "\xBF\x01\x00\x00\x00\xB8\x3C\x00\x00\x00\x0F\x05");  // exit(1)
+}
+
+static void put_le(uint8_t* at, uint64_t value, int size) {
+    for (int i = 0; i < size; i++) at[i] = (uint8_t)(value >> (8 * i));
+}
+
+// Compiles vm to a static x86-64 ELF executable: one read-only, executable
+// segment with the headers, the string literals and the code, and one
+// zero-filled writable segment for the output buffer. Returns NULL after
+// reporting what cannot be compiled.
+static uint8_t* native_executable(const VmProgram* vm, int main_function, size_t* length) {
+    NativeCode nc = {0};
+    nc.strings_address = NATIVE_BASE + NATIVE_HEADERS_SIZE;
+    nc.data_address = nc.strings_address + vm->strings_size;
+    // Labels: one per instruction, then one per function and the runtime's.
+    for (int i = 0; i < vm->code_count + vm->function_count + NUM_RUNTIME; i++) new_label(&nc);
+    nc.runtime = vm->code_count + vm->function_count;
+
+    int* function_at = malloc((vm->code_count + 1) * sizeof(int));
+    if (!function_at) nc.out_of_memory = 1;
+    for (int i = 0; !nc.out_of_memory && i < vm->code_count; i++) function_at[i] = -1;
+    for (int f = 0; !nc.out_of_memory && f < vm->function_count; f++) function_at[vm->functions[f].entry] = f;
+    int ok = 1;
+    for (int i = 0; ok && !nc.out_of_memory && i < vm->code_count; i++) {
+        if (function_at[i] >= 0) {
+            const VmFunction* f = &vm->functions[function_at[i]];
+            place_label(&nc, vm->code_count + function_at[i]);
+            EMIT(&nc, "\x55\x48\x89\xE5\x48\x81\xEC");         // push rbp; mov rbp, rsp; sub rsp, imm32
+            emit_u32(&nc, (8 * f->num_registers + 15) & ~15);
+            for (int param = 0; param < f->num_params; param++) {
+                EMIT(&nc, "\x48\x8B\x85");                     // mov rax, [rbp + 16 + 8 * param]
+                emit_u32(&nc, 16 + 8 * param);
+                EMIT_SLOT(&nc, "\x48\x89\x85", param);
+            }
+        }
+        place_label(&nc, i);
+        ok = translate_instruction(vm, &nc, &vm->code[i]);
+    }
+    free(function_at);
+    uint8_t* file = NULL;
+    size_t code_offset = NATIVE_HEADERS_SIZE + vm->strings_size + sizeof(native_data) - 1;
+    uint64_t bss_address = 0;
+    if (ok) emit_runtime(&nc, vm->code_count + main_function);
+    if (ok && nc.out_of_memory) {
+        printf("Native Error: out of memory.\n");
+        ok = 0;
+    }
+    if (ok) {
+        *length = code_offset + nc.size;
+        bss_address = (NATIVE_BASE + *length + 0xFFF) & ~(uint64_t)0xFFF;
+        // Absolute operands are sign-extended 32-bit values.
+        if (bss_address + NATIVE_BSS_SIZE > INT32_MAX) {
+            printf("Native Error: the program is too large.\n");
+            ok = 0;
+        }
+    }
+    if (ok) {
+        for (int i = 0; i < nc.fixup_count; i++) {
+            const NativeFixup* fixup = &nc.fixups[i];
+            uint8_t* operand = nc.code + fixup->at;
+            if (fixup->label < 0) {
+                uint32_t offset = operand[0] | operand[1] << 8 | operand[2] << 16 | (uint32_t)operand[3] << 24;
+                put_le(operand, bss_address + offset, 4);
+            } else {
+                put_le(operand, (uint32_t)(nc.labels[fixup->label] - (fixup->at + 4)), 4);
+            }
+        }
+
+        file = calloc(1, *length);
+        if (!file) printf("Native Error: out of memory.\n");
+    }
+    if (file) {
+        memcpy(file, "\x7F" "ELF\x02\x01\x01", 7);            // 64-bit, little-endian, version 1
+        put_le(file + 16, 2, 2);                               // executable
+        put_le(file + 18, 62, 2);                              // x86-64
+        put_le(file + 20, 1, 4);
+        put_le(file + 24, NATIVE_BASE + code_offset + nc.labels[nc.runtime + RT_START], 8);
+        put_le(file + 32, 64, 8);                              // program headers
+        put_le(file + 52, 64, 2);
+        put_le(file + 54, 56, 2);
+        put_le(file + 56, 3, 2);
+        // type, flags, offset, address, file size, memory size
+        const uint64_t segments[3][6] = {
+            {1, 5, 0, NATIVE_BASE, *length, *length},                     // PT_LOAD, r-x
+            {1, 6, 0, bss_address, 0, NATIVE_BSS_SIZE},                   // PT_LOAD, rw-
+            {0x6474E551, 6, 0, 0, 0, 0},                                  // PT_GNU_STACK, rw-
+        };
+        for (int i = 0; i < 3; i++) {
+            uint8_t* header = file + 64 + 56 * i;
+            put_le(header, segments[i][0], 4);
+            put_le(header + 4, segments[i][1], 4);
+            put_le(header + 8, segments[i][2], 8);
+            put_le(header + 16, segments[i][3], 8);
+            put_le(header + 24, segments[i][3], 8);
+            put_le(header + 32, segments[i][4], 8);
+            put_le(header + 40, segments[i][5], 8);
+            put_le(header + 48, segments[i][0] == 1 ? 0x1000 : 0x10, 8);
+        }
+        if (vm->strings_size > 0) memcpy(file + NATIVE_HEADERS_SIZE, vm->strings, vm->strings_size);
+        memcpy(file + NATIVE_HEADERS_SIZE + vm->strings_size, native_data, sizeof(native_data) - 1);
+        memcpy(file + code_offset, nc.code, nc.size);
+    }
+    free(nc.code);
+    free(nc.labels);
+    free(nc.fixups);
+    return file;
+}
+
+// --- Main Driver ---
+
+// Source text of an input file. Regular files are mapped read-only so the
+// tokenizer lexes straight from the page cache; pipes and stdin ("-") are
+// streamed into a heap buffer instead.
+typedef struct {
+    const char* data;
+    size_t length;
+    int mapped;
+} SourceBuffer;
+
+// Returns 0 (after reporting why on stderr) if the file cannot be read.
+static int read_file(const char* path, SourceBuffer* source) {
+    *source = (SourceBuffer){NULL, 0, 0};
+    int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) { fprintf(stderr, "Could not open file \"%s\".\n", path); return 0; }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        fprintf(stderr, "Could not stat file \"%s\".\n", path);
+        if (fd != STDIN_FILENO) close(fd);
+        return 0;
+    }
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            if (fd != STDIN_FILENO) close(fd);
+            source->data = data;
+            source->length = st.st_size;
+            source->mapped = 1;
+            return 1;
+        }
+    }
+
+    size_t capacity = S_ISREG(st.st_mode) && st.st_size > 0 ? (size_t)st.st_size + 1 : 4096;
+    char* buffer = malloc(capacity);
+    const char* error = buffer ? NULL : "Not enough memory to read";
+    while (!error) {
+        if (source->length + 1 >= capacity) {
+            char* grown = realloc(buffer, capacity * 2);
+            if (!grown) { error = "Not enough memory to read"; break; }
+            buffer = grown;
+            capacity *= 2;
+        }
+        ssize_t n = read(fd, buffer + source->length, capacity - source->length - 1);
+        if (n < 0) { error = "Could not read file"; break; }
+        if (n == 0) break;
+        source->length += n;
+    }
+    if (fd != STDIN_FILENO) close(fd);
+    if (error) {
+        fprintf(stderr, "%s \"%s\".\n", error, path);
+        free(buffer);
+        source->length = 0;
+        return 0;
+    }
+    buffer[source->length] = '\0';
+    source->data = buffer;
+    return 1;
+}
+
+static void write_to_file(void* file, const char* data, size_t length) {
+    fwrite(data, 1, length, file);
+}
+
+// The command line's use of the library: collects the C into a malloc'd
+// string and prints diagnostics on stdout. Returns NULL on failure.
+static char* transpile_to_string(const char* source, size_t length) {
+    char* output = NULL;
+    size_t size = 0;
+    FILE* stream = open_memstream(&output, &size);
+    if (!stream) return NULL;
+    YodaSink sink = {write_to_file, stream};
+    YodaDiagnostics diagnostics = {write_diagnostic_to_file, stdout};
+    YodaStatus status = yoda_transpile(source, length, &sink, &diagnostics);
+    fclose(stream);
+    if (status == YODA_OK) return output;
+    if (status == YODA_OUT_OF_MEMORY) printf("Out of memory.\n");
+    free(output);
+    return NULL;
+}
+
+static void free_source(SourceBuffer* source) {
+    if (source->mapped) munmap((void*)source->data, source->length);
+    else free((void*)source->data);
+}
+
+// --- Compiling ---
+
+extern char** environ;
+
+typedef struct {
+    const char* cc;          // compiler to run, looked up in PATH
+    const char** flags;      // extra compiler flags
+    int num_flags;
+    const char* output;      // executable to produce
+} CompileOptions;
+
+// Streams the C code into the compiler's stdin ("cc -x c -pipe ... -"), so
+// neither an intermediate .c file nor a shell is involved. Returns the
+// compiler's pid once it has all the input, or -1 if it could not be run.
+static pid_t start_compiler(const char* c_code, size_t length, const CompileOptions* options) {
+    const char** args = malloc((options->num_flags + 8) * sizeof(char*));
+    int n = 0;
+    args[n++] = options->cc;
+    args[n++] = "-x";
+    args[n++] = "c";
+    args[n++] = "-pipe";
+    for (int i = 0; i < options->num_flags; i++) args[n++] = options->flags[i];
+    args[n++] = "-o";
+    args[n++] = options->output;
+    args[n++] = "-";
+    args[n] = NULL;
+
+    int fds[2];
+    if (pipe(fds) != 0) { free(args); return -1; }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+    posix_spawn_file_actions_addclose(&actions, fds[0]);
+    posix_spawn_file_actions_addclose(&actions, fds[1]);
+    pid_t pid;
+    int spawn_error = posix_spawnp(&pid, options->cc, &actions, NULL, (char* const*)args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    free(args);
+    close(fds[0]);
+    if (spawn_error != 0) { close(fds[1]); return -1; }
+
+    // A compiler that exits early must not kill us with SIGPIPE.
+    void (*previous_handler)(int) = signal(SIGPIPE, SIG_IGN);
+    size_t written = 0;
+    while (written < length) {
+        ssize_t w = write(fds[1], c_code + written, length - written);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) break;
+        written += w;
+    }
+    close(fds[1]);
+    signal(SIGPIPE, previous_handler);
+    return pid;
+}
+
+// Waits for the compiler and returns its exit status, or -1 if it was
+// killed or could not be run.
+static int finish_compiler(pid_t pid) {
+    int status;
+    if (pid < 0) return -1;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static int compile_c(const char* c_code, size_t length, const CompileOptions* options) {
+    return finish_compiler(start_compiler(c_code, length, options));
+}
+
+static int write_file(const char* path, const char* data, size_t length) {
+    FILE* file = fopen(path, "w");
+    if (!file) return 0;
+    int ok = fwrite(data, 1, length, file) == length;
+    return fclose(file) == 0 && ok;
+}
+
+// --- Build Cache ---
+
+// Cached results are addressed by a hash of everything that determines
+// them: the transpiler build, the compiler and its flags, and the source
+// bytes. Each entry is a directory <cache>/<hash> holding "key" (that
+// material verbatim, checked on lookup so a hash collision can never
+// serve the wrong result), "out.c" and, when compiled, "bin". Files are
+// written to a temporary name and renamed into place, and "key" is
+// written last, so concurrent runs only ever see complete entries.
+#define YODA_VERSION "1.0"
+#define YODA_BUILD_ID YODA_VERSION " " __DATE__ " " __TIME__
+
+typedef struct {
+    char* key;
+    size_t key_length;
+    char* dir;
+} CacheEntry;
+
+static unsigned long long fnv1a64(const char* data, size_t length) {
+    unsigned long long h = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++) h = (h ^ (unsigned char)data[i]) * 1099511628211ull;
+    return h;
+}
+
+// Creates path and any missing parents.
+static int make_directories(const char* path) {
+    char* copy = strdup(path);
+    for (char* p = copy + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        mkdir(copy, 0755);
+        *p = '/';
+    }
+    int ok = mkdir(copy, 0755) == 0 || errno == EEXIST;
+    free(copy);
+    return ok;
+}
+
+// compile is NULL for entries that only hold generated C.
+static void cache_entry_init(CacheEntry* entry, const char* cache_dir, const char* source, size_t length,
+                      const CompileOptions* compile) {
+    FILE* key = open_memstream(&entry->key, &entry->key_length);
+    fprintf(key, "yoda %s", YODA_BUILD_ID);
+    fputc('\0', key);
+    if (compile) {
+        fputs(compile->cc, key);
+        fputc('\0', key);
+        for (int i = 0; i < compile->num_flags; i++) {
+            fputs(compile->flags[i], key);
+            fputc('\0', key);
+        }
+    }
+    fputc('\0', key);
+    fwrite(source, 1, length, key);
+    fclose(key);
+
+    size_t dir_length = strlen(cache_dir) + 18;
+    entry->dir = malloc(dir_length);
+    snprintf(entry->dir, dir_length, "%s/%016llx", cache_dir, fnv1a64(entry->key, entry->key_length));
+}
+
+static void free_cache_entry(CacheEntry* entry) {
+    free(entry->key);
+    free(entry->dir);
+}
+
+static char* cache_path(const CacheEntry* entry, const char* name) {
+    size_t length = strlen(entry->dir) + strlen(name) + 2;
+    char* path = malloc(length);
+    snprintf(path, length, "%s/%s", entry->dir, name);
+    return path;
+}
+
+// Reads a whole file into a NUL-terminated heap buffer, or returns NULL.
+static char* read_whole_file(const char* path, size_t* length_out) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0) { close(fd); return NULL; }
+    char* data = malloc(st.st_size + 1);
+    size_t length = 0;
+    while (length < (size_t)st.st_size) {
+        ssize_t n = read(fd, data + length, st.st_size - length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        length += n;
+    }
+    close(fd);
+    if (length != (size_t)st.st_size) { free(data); return NULL; }
+    data[length] = '\0';
+    if (length_out) *length_out = length;
+    return data;
+}
+
+// Writes data to path through a temporary file and rename, so readers see
+// either the old file or the complete new one.
+static int write_file_atomic(const char* path, const char* data, size_t length, mode_t mode) {
+    size_t tmp_length = strlen(path) + 32;
+    char* tmp = malloc(tmp_length);
+    snprintf(tmp, tmp_length, "%s.tmp.%ld.%lu", path, (long)getpid(), (unsigned long)pthread_self());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, mode);
+    int ok = fd >= 0;
+    size_t written = 0;
+    while (ok && written < length) {
+        ssize_t n = write(fd, data + written, length - written);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) ok = 0;
+        else written += n;
+    }
+    if (fd >= 0 && close(fd) != 0) ok = 0;
+    if (ok) ok = rename(tmp, path) == 0;
+    if (!ok) unlink(tmp);
+    free(tmp);
+    return ok;
+}
+
+static int cache_entry_valid(const CacheEntry* entry) {
+    char* path = cache_path(entry, "key");
+    size_t length;
+    char* key = read_whole_file(path, &length);
+    free(path);
+    int valid = key && length == entry->key_length && memcmp(key, entry->key, length) == 0;
+    free(key);
+    return valid;
+}
+
+static char* cache_read(const CacheEntry* entry, const char* name, size_t* length) {
+    char* path = cache_path(entry, name);
+    char* data = read_whole_file(path, length);
+    free(path);
+    return data;
+}
+
+static int cache_write(const CacheEntry* entry, const char* name, const char* data, size_t length, mode_t mode) {
+    char* path = cache_path(entry, name);
+    int ok = write_file_atomic(path, data, length, mode);
+    free(path);
+    return ok;
+}
+
+// Stores generated C and, if binary is set, the compiled executable.
+static void cache_store(const CacheEntry* entry, const char* c_code, size_t c_length, const char* binary, size_t binary_length) {
+    if (!make_directories(entry->dir)) return;
+    if (!cache_write(entry, "out.c", c_code, c_length, 0644)) return;
+    if (binary && !cache_write(entry, "bin", binary, binary_length, 0755)) return;
+    cache_write(entry, "key", entry->key, entry->key_length, 0644);
+}
+
+// The cache directory: --cache-dir, else $YODA_CACHE_DIR; NULL disables caching.
+static const char* default_cache_dir(void) {
+    const char* dir = getenv("YODA_CACHE_DIR");
+    return dir && *dir ? dir : NULL;
+}
+
+// --- Batch Mode ---
+
+// Output path for an input: "dir/name.ydc" becomes "dir/name.c".
+static char* c_output_path(const char* input) {
+    size_t len = strlen(input);
+    if (len > 4 && strcmp(input + len - 4, ".ydc") == 0) len -= 4;
+    char* path = malloc(len + 3);
+    memcpy(path, input, len);
+    memcpy(path + len, ".c", 3);
+    return path;
+}
+
+typedef struct {
+    char** inputs;
+    int* failed;
+    int function_threads; // > 1: split each file's functions across threads
+    const char* cache_dir;
+} BatchJob;
+
+// Each file gets its own Parser and buffers; workers share nothing mutable.
+static void transpile_batch_file(void* ctx, int index) {
+    BatchJob* job = ctx;
+    const char* input = job->inputs[index];
+    SourceBuffer source;
+    if (!read_file(input, &source)) {
+        job->failed[index] = 1;
+        return;
+    }
+    CacheEntry entry;
+    if (job->cache_dir) {
+        cache_entry_init(&entry, job->cache_dir, source.data, source.length, NULL);
+    }
+    char* c_code;
+    if (job->cache_dir && cache_entry_valid(&entry)) {
+        c_code = cache_read(&entry, "out.c", NULL);
+    } else if (job->function_threads > 1) {
+        TokenList tokens = tokenize(source.data, source.length);
+        c_code = parse_parallel(tokens, job->function_threads);
+        free_tokens(&tokens);
+    } else {
+        c_code = transpile_to_string(source.data, source.length);
+    }
+    free_source(&source);
+    if (!c_code) {
+        printf("Failed to transpile \"%s\" due to parsing errors.\n", input);
+        job->failed[index] = 1;
+        if (job->cache_dir) free_cache_entry(&entry);
+        return;
+    }
+    size_t c_length = strlen(c_code);
+    if (job->cache_dir) {
+        if (!cache_entry_valid(&entry)) cache_store(&entry, c_code, c_length, NULL, 0);
+        free_cache_entry(&entry);
+    }
+    char* output_path = c_output_path(input);
+    if (!write_file(output_path, c_code, c_length)) {
+        printf("Error: could not write %s\n", output_path);
+        job->failed[index] = 1;
+    }
+    free(output_path);
+    free(c_code);
+}
+
+// With a single input the threads go to its functions instead of to files.
+static int run_batch(char** inputs, int count, int num_threads, const char* cache_dir) {
+    BatchJob job = {inputs, calloc(count, sizeof(int)), count == 1 ? num_threads : 1, cache_dir};
+    run_parallel(count, num_threads, transpile_batch_file, &job);
+    int failures = 0;
+    for (int i = 0; i < count; i++) failures += job.failed[i];
+    free(job.failed);
+    printf("Transpiled %d of %d files.\n", count - failures, count);
+    return failures == 0 ? 0 : 1;
+}
+
+// --- Benchmark ---
+
+static double monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Shape of a generated benchmark program.
+typedef struct {
+    int functions;
+    int depth;       // nesting of if/while/for blocks in each function
+    int args;        // parameters per function and arguments per call
+    int string;      // length of each string literal
+} BenchShape;
+
+#define BENCH_DEFAULT_SHAPE ((BenchShape){2000, 6, 8, 64})
+
+// Parses "functions=N,depth=N,args=N,string=N" (any subset, any order).
+static int parse_bench_shape(const char* spec, BenchShape* shape) {
+    while (*spec) {
+        const char* eq = strchr(spec, '=');
+        if (!eq) return 0;
+        char* end;
+        long value = strtol(eq + 1, &end, 10);
+        if (end == eq + 1 || value < 0 || value > INT_MAX || (*end && *end != ',')) return 0;
+        int key_length = eq - spec;
+        if (key_length == 9 && strncmp(spec, "functions", 9) == 0) shape->functions = value;
+        else if (key_length == 5 && strncmp(spec, "depth", 5) == 0) shape->depth = value;
+        else if (key_length == 4 && strncmp(spec, "args", 4) == 0) shape->args = value;
+        else if (key_length == 6 && strncmp(spec, "string", 6) == 0) shape->string = value;
+        else return 0;
+        spec = *end ? end + 1 : end;
+    }
+    return 1;
+}
+
+static void generate_bench_block(FILE* out, const BenchShape* shape, int level) {
+    int indent = 4 * (level + 1);
+    fprintf(out, "%*s%d = v%d int;\n", indent, "", level, level);
+    fprintf(out, "%*s(\"", indent, "");
+    for (int i = 0; i < shape->string; i++) fputc('a' + i % 26, out);
+    fputs("\\n\"", out);
+    for (int i = 0; i < shape->args; i++) fprintf(out, ", a%d", i);
+    fputs(")printf;\n", out);
+    if (level == shape->depth) return;
+
+    static const char* const loops[] = {"if", "while", "for"};
+    const char* loop = loops[level % 3];
+    if (strcmp(loop, "for") == 0) {
+        fprintf(out, "%*s(int i%d = 0; i%d < a0; i%d = i%d) for {\n", indent, "", level, level, level, level);
+    } else {
+        fprintf(out, "%*s(v%d >= a0) %s {\n", indent, "", level, loop);
+    }
+    generate_bench_block(out, shape, level + 1);
+    fprintf(out, "%*s}", indent, "");
+    if (strcmp(loop, "if") == 0) {
+        fputs(" else {\n", out);
+        fprintf(out, "%*sreturn v%d;\n", indent + 4, "", level);
+        fprintf(out, "%*s}", indent, "");
+    }
+    fputc('\n', out);
+}
+
+// A synthetic Yoda program exercising every construct the parser knows.
+static char* generate_bench_program(const BenchShape* shape, size_t* length_out) {
+    char* program = NULL;
+    FILE* out = open_memstream(&program, length_out);
+    fputs("#include <stdio.h>\n\n", out);
+    for (int f = 0; f < shape->functions; f++) {
+        fputc('(', out);
+        for (int i = 0; i < shape->args; i++) fprintf(out, "%sa%d int", i ? ", " : "", i);
+        fprintf(out, ")f%d int {\n", f);
+        generate_bench_block(out, shape, 0);
+        fputs("    return 0;\n}\n\n", out);
+    }
+    fclose(out);
+    return program;
+}
+
+// Stage measurements: the best of several runs, as throughput.
+typedef struct {
+    const char* name;
+    size_t bytes;       // bytes the stage consumes (or writes)
+    int tokens;         // tokens it handles; 0 if not meaningful
+    double best_ms;
+} BenchStage;
+
+enum { BENCH_TOKENIZE, BENCH_PARSE, BENCH_TRANSPILE, BENCH_WRITE, BENCH_NUM_STAGES };
+
+static double bench_bytes_per_sec(const BenchStage* stage) {
+    return stage->best_ms > 0 ? stage->bytes / (stage->best_ms / 1000.0) : 0;
+}
+
+static double bench_tokens_per_sec(const BenchStage* stage) {
+    return stage->best_ms > 0 ? stage->tokens / (stage->best_ms / 1000.0) : 0;
+}
+
+static void bench_time(BenchStage* stage, double start_ms) {
+    double elapsed = monotonic_ms() - start_ms;
+    if (stage->best_ms == 0 || elapsed < stage->best_ms) stage->best_ms = elapsed;
+}
+
+// Baseline files hold one line per stage: "<stage> <bytes/s> <tokens/s>",
+// after a "shape ..." line recording what was measured.
+static int save_bench_baseline(const char* path, const BenchShape* shape, const BenchStage* stages) {
+    FILE* file = fopen(path, "w");
+    if (!file) return 0;
+    fprintf(file, "shape functions=%d,depth=%d,args=%d,string=%d\n", shape->functions, shape->depth,
+            shape->args, shape->string);
+    for (int i = 0; i < BENCH_NUM_STAGES; i++) {
+        fprintf(file, "%s %.0f %.0f\n", stages[i].name, bench_bytes_per_sec(&stages[i]), bench_tokens_per_sec(&stages[i]));
+    }
+    return fclose(file) == 0;
+}
+
+// Compares bytes/s with a saved baseline; returns the number of stages
+// slower than the baseline by more than BENCH_REGRESSION_PERCENT, or -1 if
+// the baseline cannot be read.
+#define BENCH_REGRESSION_PERCENT 15.0
+
+static int compare_bench_baseline(const char* path, const BenchShape* shape, const BenchStage* stages) {
+    FILE* file = fopen(path, "r");
+    if (!file) return -1;
+    char line[256], expected_shape[128];
+    snprintf(expected_shape, sizeof(expected_shape), "shape functions=%d,depth=%d,args=%d,string=%d\n",
+             shape->functions, shape->depth, shape->args, shape->string);
+    int regressions = 0;
+    printf("\nCompared with %s:\n", path);
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, "shape ", 6) == 0) {
+            if (strcmp(line, expected_shape) != 0) printf("  (baseline was measured with a different %s", line);
+            continue;
+        }
+        char name[32];
+        double bytes_per_sec, tokens_per_sec;
+        if (sscanf(line, "%31s %lf %lf", name, &bytes_per_sec, &tokens_per_sec) != 3) continue;
+        for (int i = 0; i < BENCH_NUM_STAGES; i++) {
+            if (strcmp(stages[i].name, name) != 0 || bytes_per_sec <= 0) continue;
+            double change = (bench_bytes_per_sec(&stages[i]) / bytes_per_sec - 1) * 100;
+            int regressed = change < -BENCH_REGRESSION_PERCENT;
+            regressions += regressed;
+            printf("  %-10s %+7.1f%%%s\n", name, change, regressed ? "  REGRESSION" : "");
+        }
+    }
+    fclose(file);
+    return regressions;
+}
+
+// Measures tokenize(), parse() on the token list, the streaming transpile
+// (parse_source, what a normal run uses) and writing the C out, each on the
+// same generated program.
+static int run_bench(const BenchShape* shape, int repeat, const char* save_path, const char* compare_path) {
+    size_t length;
+    char* source = generate_bench_program(shape, &length);
+    BenchStage stages[BENCH_NUM_STAGES] = {
+        [BENCH_TOKENIZE] = {"tokenize", length, 0, 0},
+        [BENCH_PARSE] = {"parse", length, 0, 0},
+        [BENCH_TRANSPILE] = {"transpile", length, 0, 0},
+        [BENCH_WRITE] = {"write", 0, 0, 0},
+    };
+
+    char path[] = "/tmp/yoda-bench-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) { printf("Error: could not create a temporary file.\n"); free(source); return 1; }
+    close(fd);
+
+    int ok = 1;
+    for (int run = 0; run < repeat && ok; run++) {
+        double start = monotonic_ms();
+        TokenList tokens = tokenize(source, length);
+        bench_time(&stages[BENCH_TOKENIZE], start);
+
+        start = monotonic_ms();
+        char* c_code = parse(tokens);
+        bench_time(&stages[BENCH_PARSE], start);
+        for (int i = 0; i < BENCH_NUM_STAGES; i++) stages[i].tokens = tokens.count;
+        free_tokens(&tokens);
+
+        start = monotonic_ms();
+        char* streamed = parse_source(source, length);
+        bench_time(&stages[BENCH_TRANSPILE], start);
+        free(streamed);
+
+        if (!c_code) { ok = 0; break; }
+        stages[BENCH_WRITE].bytes = strlen(c_code);
+        start = monotonic_ms();
+        ok = write_file(path, c_code, stages[BENCH_WRITE].bytes);
+        bench_time(&stages[BENCH_WRITE], start);
+        free(c_code);
+    }
+    unlink(path);
+    free(source);
+    if (!ok) { printf("Error: the benchmark program did not transpile.\n"); return 1; }
+    stages[BENCH_WRITE].tokens = 0;
+
+    printf("Benchmark: functions=%d depth=%d args=%d string=%d, %zu bytes, %d tokens, best of %d\n",
+           shape->functions, shape->depth, shape->args, shape->string, length, stages[BENCH_TOKENIZE].tokens, repeat);
+    printf("  %-10s %10s %10s %12s\n", "stage", "ms", "MB/s", "Mtokens/s");
+    for (int i = 0; i < BENCH_NUM_STAGES; i++) {
+        printf("  %-10s %10.3f %10.1f", stages[i].name, stages[i].best_ms, bench_bytes_per_sec(&stages[i]) / 1e6);
+        if (stages[i].tokens) printf(" %12.2f\n", bench_tokens_per_sec(&stages[i]) / 1e6);
+        else printf(" %12s\n", "-");
+    }
+
+    int status = 0;
+    if (save_path && !save_bench_baseline(save_path, shape, stages)) {
+        printf("Error: could not write %s\n", save_path);
+        status = 1;
+    }
+    if (compare_path) {
+        int regressions = compare_bench_baseline(compare_path, shape, stages);
+        if (regressions < 0) { printf("Error: could not read %s\n", compare_path); status = 1; }
+        if (regressions > 0) status = 1;
+    }
+    return status;
+}
+
+// --- Statistics ---
+
+static const char* const token_type_names[NUM_TOKEN_TYPES] = {
+    "keyword", "identifier", "number", "lparen", "rparen", "lbrace", "rbrace",
+    "equals", "semicolon", "comma", "operator", "preprocessor", "eof", "unknown"
+};
+
+// What --stats reports for a single-file run. Stage times are wall-clock
+// milliseconds; a stage that did not run stays at -1.
+typedef struct {
+    double read_ms;
+    double tokenize_ms;
+    double parse_ms;
+    double emit_ms;      // printing the C and writing --emit-c
+    double compile_ms;   // the compiler subprocess, including feeding it
+    size_t source_bytes;
+    int tokens;
+    int token_counts[NUM_TOKEN_TYPES];
+    int token_grow_events;
+    long append_calls;
+    size_t output_bytes;
+    int output_grow_events;
+    int cached;          // 1 if the build came from the cache
+    int compile_status;
+} TranspileStats;
+
+#define TRANSPILE_STATS_INIT \
+    ((TranspileStats){.read_ms = -1, .tokenize_ms = -1, .parse_ms = -1, .emit_ms = -1, .compile_ms = -1, \
+                      .source_bytes = 0, .tokens = 0, .token_counts = {0}, .token_grow_events = 0, \
+                      .append_calls = 0, .output_bytes = 0, .output_grow_events = 0, .cached = 0, \
+                      .compile_status = 0})
+
+// Tokenizes and parses as separate stages (rather than streaming) so each
+// can be timed; the output is the same as parse_source's.
+static char* transpile_with_stats(const char* source, size_t length, TranspileStats* stats) {
+    double start = monotonic_ms();
+    TokenList tokens = tokenize(source, length);
+    stats->tokenize_ms = monotonic_ms() - start;
+    stats->tokens = tokens.count;
+    for (int i = 0; i < tokens.count; i++) stats->token_counts[tokens.types[i]]++;
+    stats->token_grow_events = tokens.grow_events;
+
+    start = monotonic_ms();
+    Parser p = {.tokens = tokens};
+    char* output = parse_program(&p, INT_MAX);
+    stats->parse_ms = monotonic_ms() - start;
+    stats->append_calls = p.append_calls;
+    stats->output_grow_events = p.output_grow_events;
+    stats->output_bytes = output ? p.output_size : 0;
+    free_tokens(&tokens);
+    return output;
+}
+
+static void print_stage_json(FILE* out, const char* name, double ms, int last) {
+    if (ms < 0) fprintf(out, "    \"%s\": null%s\n", name, last ? "" : ",");
+    else fprintf(out, "    \"%s\": %.3f%s\n", name, ms, last ? "" : ",");
+}
+
+static void print_stats_json(FILE* out, const TranspileStats* stats) {
+    fprintf(out, "{\n  \"stages_ms\": {\n");
+    print_stage_json(out, "read", stats->read_ms, 0);
+    print_stage_json(out, "tokenize", stats->tokenize_ms, 0);
+    print_stage_json(out, "parse", stats->parse_ms, 0);
+    print_stage_json(out, "emit", stats->emit_ms, 0);
+    print_stage_json(out, "compile", stats->compile_ms, 1);
+    fprintf(out, "  },\n");
+    fprintf(out, "  \"cached\": %s,\n", stats->cached ? "true" : "false");
+    fprintf(out, "  \"source_bytes\": %zu,\n", stats->source_bytes);
+    fprintf(out, "  \"tokens\": %d,\n", stats->tokens);
+    fprintf(out, "  \"tokens_by_type\": {");
+    for (int i = 0; i < NUM_TOKEN_TYPES; i++) {
+        fprintf(out, "%s\"%s\": %d", i ? ", " : "", token_type_names[i], stats->token_counts[i]);
+    }
+    fprintf(out, "},\n");
+    fprintf(out, "  \"token_list_grow_events\": %d,\n", stats->token_grow_events);
+    fprintf(out, "  \"append_output_calls\": %ld,\n", stats->append_calls);
+    fprintf(out, "  \"output_bytes\": %zu,\n", stats->output_bytes);
+    fprintf(out, "  \"output_grow_events\": %d,\n", stats->output_grow_events);
+    fprintf(out, "  \"compile_status\": %d\n", stats->compile_status);
+    fprintf(out, "}\n");
+}
+
+// "-" (plain --stats) means stderr, so the JSON stays apart from the
+// transpiled code on stdout.
+static void write_stats(const char* path, const TranspileStats* stats) {
+    if (strcmp(path, "-") == 0) {
+        print_stats_json(stderr, stats);
+        return;
+    }
+    FILE* out = fopen(path, "w");
+    if (!out) { printf("Error: could not write %s\n", path); return; }
+    print_stats_json(out, stats);
+    fclose(out);
+}
+
+// --- Tiered Execution ---
+
+// "yoda run --tiered" starts in the VM at once while a thread transpiles
+// the program and builds it with gcc -O2 as a shared object. Once that is
+// loaded, calls to functions with int-only signatures go to the compiled
+// code. A function that is already running, such as main, stays in the VM
+// until it returns. If the program ends first, the build is cancelled.
+typedef struct {
+    PromotedCode promoted;
+    const VmProgram* vm;
+    const char* source;
+    size_t length;
+    char path[32];           // the shared object being built
+    pthread_t thread;
+    pthread_mutex_t lock;    // guards compiler and cancelled
+    pid_t compiler;          // gcc while it runs, else 0
+    int cancelled;
+    void* library;
+} TieredBuild;
+
+static void* tiered_build_thread(void* arg) {
+    // Wrapped arithmetic and locally bound calls, like the VM's.
+    static const char* flags[] = {"-O2", "-shared", "-fPIC", "-fwrapv", "-w", "-include", "stdio.h", "-Wl,-Bsymbolic"};
+    TieredBuild* build = arg;
+    CompileOptions options = {"gcc", flags, sizeof(flags) / sizeof(flags[0]), build->path};
+    char* c_code = transpile_to_string(build->source, build->length);
+    pid_t pid = -1;
+    pthread_mutex_lock(&build->lock);
+    if (c_code && !build->cancelled) pid = start_compiler(c_code, strlen(c_code), &options);
+    build->compiler = pid > 0 ? pid : 0;
+    pthread_mutex_unlock(&build->lock);
+    free(c_code);
+
+    // Waiting without reaping keeps the pid from being reused before it
+    // is cleared, so finish_tiered_build never signals another process.
+    siginfo_t info;
+    while (pid > 0 && waitid(P_PID, pid, &info, WEXITED | WNOWAIT) < 0 && errno == EINTR) {}
+    pthread_mutex_lock(&build->lock);
+    build->compiler = 0;
+    int cancelled = build->cancelled;
+    pthread_mutex_unlock(&build->lock);
+    if (finish_compiler(pid) == 0 && !cancelled) build->library = dlopen(build->path, RTLD_NOW | RTLD_LOCAL);
+    unlink(build->path);
+    if (!build->library) return NULL;
+
+    const VmProgram* vm = build->vm;
+    for (int f = 0; f < vm->function_count; f++) {
+        Slice name = vm->functions[f].name;
+        if (!vm->functions[f].int_signature) continue;
+        char* symbol = strndup(vm->source + name.offset, name.length);
+        build->promoted.entries[f] = dlsym(build->library, symbol);
+        free(symbol);
+    }
+    atomic_store_explicit(&build->promoted.ready, 1, memory_order_release);
+    return NULL;
+}
+
+// Returns 0 if the build cannot be started; the program then only runs in
+// the VM.
+static int start_tiered_build(TieredBuild* build, const VmProgram* vm, const char* source, size_t length) {
+    *build = (TieredBuild){.vm = vm, .source = source, .length = length};
+    strcpy(build->path, "/tmp/yoda-tier-XXXXXX");
+    int fd = mkstemp(build->path);
+    if (fd < 0) return 0;
+    close(fd);
+    build->promoted.entries = calloc(vm->function_count, sizeof(void*));
+    pthread_mutex_init(&build->lock, NULL);
+    if (!build->promoted.entries || pthread_create(&build->thread, NULL, tiered_build_thread, build) != 0) {
+        unlink(build->path);
+        free(build->promoted.entries);
+        pthread_mutex_destroy(&build->lock);
+        return 0;
+    }
+    return 1;
+}
+
+static void finish_tiered_build(TieredBuild* build) {
+    pthread_mutex_lock(&build->lock);
+    build->cancelled = 1;
+    if (build->compiler > 0) kill(build->compiler, SIGTERM);
+    pthread_mutex_unlock(&build->lock);
+    pthread_join(build->thread, NULL);
+    if (build->library) dlclose(build->library);
+    free(build->promoted.entries);
+    pthread_mutex_destroy(&build->lock);
+}
+
+// --- Command Line ---
+
+typedef struct {
+    int run;                 // "run": interpret the program instead of compiling it
+    int tiered;              // run --tiered: switch calls to gcc-compiled code once built
+    int native;              // compile to x86-64 without a C compiler
+    int num_threads;
+    const char* emit_c;      // also write the generated C here
+    const char* cache_dir;   // NULL disables the build cache
+    int watch;
+    const char* serve;       // Unix socket path for --serve
+    const char* stats;       // write --stats JSON here ("-" for stderr)
+    int bench;
+    BenchShape bench_shape;
+    int bench_repeat;
+    const char* bench_save;      // write the benchmark results here
+    const char* bench_compare;   // compare them with a file written by bench_save
+    const char* bench_generate;  // only write the generated program here
+    CompileOptions compile;
+    char** inputs;
+    int num_inputs;
+} Options;
+
+static void print_usage(const char* program) {
+    printf("Usage: %s [options] <filename.ydc>\n", program);
+    printf("       %s [-j N] <file.ydc>...   transpile each file to <file>.c\n", program);
+    printf("       %s run <file.ydc>         run the program in the bytecode VM (no C compiler)\n", program);
+    printf("       %s run --tiered <file.ydc> also build it with gcc -O2 in the background and\n", program);
+    printf("                                 switch calls to the compiled code once it is ready\n");
+    printf("Options:\n");
+    printf("  -o <file>        name of the compiled executable (default: output)\n");
+    printf("  --emit-c <file>  also write the generated C code to <file>\n");
+    printf("  --cc <compiler>  C compiler to run (default: gcc)\n");
+    printf("  -Xcc <flag>      pass <flag> to the C compiler (repeatable)\n");
+    printf("  --native         compile straight to an x86-64 Linux executable, without\n");
+    printf("                   a C compiler (one input; printf takes %%d %%i %%u %%c %%s)\n");
+    printf("  -j <N>           worker threads\n");
+    printf("  --watch          rebuild whenever an input changes, re-parsing only the\n");
+    printf("                   declarations that changed\n");
+    printf("  --cache-dir <d>  reuse generated C and executables cached in <d>\n");
+    printf("                   (default: $YODA_CACHE_DIR; caching is off if neither is set)\n");
+    printf("  --serve <sock>   (no inputs) transpile requests sent to the Unix socket\n");
+    printf("                   <sock>, serving -j clients at a time (default: 4)\n");
+    printf("  --stats[=<file>] report per-stage timings and counters as JSON on stderr\n");
+    printf("                   (or in <file>)\n");
+    printf("Benchmark (no inputs):\n");
+    printf("  --bench                measure each stage on a generated program\n");
+    printf("  --bench-shape <spec>   functions=N,depth=N,args=N,string=N\n");
+    printf("                         (default: functions=2000,depth=6,args=8,string=64)\n");
+    printf("  --bench-repeat <N>     runs per stage; the best is reported (default: 5)\n");
+    printf("  --bench-save <file>    store the results as a baseline\n");
+    printf("  --bench-compare <file> compare with a baseline; fail on a >15%% slowdown\n");
+    printf("  --bench-generate <f>   write the generated program to <f> and exit\n");
+}
+
+// Returns 0 on success; on a usage error prints usage and returns 1.
+static int parse_options(int argc, char* argv[], Options* options) {
+    *options = (Options){0};
+    options->compile.cc = "gcc";
+    options->compile.output = "output";
+    options->cache_dir = default_cache_dir();
+    options->bench_shape = BENCH_DEFAULT_SHAPE;
+    options->bench_repeat = 5;
+    options->compile.flags = malloc(argc * sizeof(char*));
+    options->inputs = malloc(argc * sizeof(char*));
+    if (argc > 1 && strcmp(argv[1], "run") == 0) {
+        options->tiered = argc == 4 && strcmp(argv[2], "--tiered") == 0;
+        if (argc != 3 + options->tiered) goto usage;
+        options->run = 1;
+        options->inputs[options->num_inputs++] = argv[argc - 1];
+        return 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(arg, "-j") == 0 && value) {
+            options->num_threads = atoi(value);
+            i++;
+            if (options->num_threads < 1) goto usage;
+        } else if (strncmp(arg, "-j", 2) == 0 && arg[2] != '\0') {
+            options->num_threads = atoi(arg + 2);
+            if (options->num_threads < 1) goto usage;
+        } else if (strcmp(arg, "-o") == 0 && value) {
+            options->compile.output = value;
+            i++;
+        } else if (strcmp(arg, "--emit-c") == 0 && value) {
+            options->emit_c = value;
+            i++;
+        } else if (strcmp(arg, "--cc") == 0 && value) {
+            options->compile.cc = value;
+            i++;
+        } else if (strcmp(arg, "--native") == 0) {
+            options->native = 1;
+        } else if (strcmp(arg, "--watch") == 0) {
+            options->watch = 1;
+        } else if (strcmp(arg, "--serve") == 0 && value) {
+            options->serve = value;
+            i++;
+        } else if (strcmp(arg, "--stats") == 0) {
+            options->stats = "-";
+        } else if (strncmp(arg, "--stats=", 8) == 0 && arg[8] != '\0') {
+            options->stats = arg + 8;
+        } else if (strcmp(arg, "--bench") == 0) {
+            options->bench = 1;
+        } else if (strcmp(arg, "--bench-shape") == 0 && value) {
+            if (!parse_bench_shape(value, &options->bench_shape)) goto usage;
+            options->bench = 1;
+            i++;
+        } else if (strcmp(arg, "--bench-repeat") == 0 && value) {
+            options->bench_repeat = atoi(value);
+            if (options->bench_repeat < 1) goto usage;
+            options->bench = 1;
+            i++;
+        } else if (strcmp(arg, "--bench-save") == 0 && value) {
+            options->bench_save = value;
+            options->bench = 1;
+            i++;
+        } else if (strcmp(arg, "--bench-compare") == 0 && value) {
+            options->bench_compare = value;
+            options->bench = 1;
+            i++;
+        } else if (strcmp(arg, "--bench-generate") == 0 && value) {
+            options->bench_generate = value;
+            options->bench = 1;
+            i++;
+        } else if (strcmp(arg, "--cache-dir") == 0 && value) {
+            options->cache_dir = value;
+            i++;
+        } else if (strcmp(arg, "-Xcc") == 0 && value) {
+            options->compile.flags[options->compile.num_flags++] = value;
+            i++;
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            goto usage;
+        } else {
+            options->inputs[options->num_inputs++] = argv[i];
+        }
+    }
+    if (options->native && options->num_inputs != 1) goto usage;
+    if (options->num_inputs > 0 || options->bench || options->serve) return 0;
+usage:
+    print_usage(argv[0]);
+    free(options->compile.flags);
+    free(options->inputs);
+    return 1;
+}
+
+static void free_options(Options* options) {
+    free(options->compile.flags);
+    free(options->inputs);
+}
+
+static void report_compile_result(int result, const CompileOptions* compile) {
+    const char* output = compile->output;
+    if (result == 0) {
+        printf("\nSuccess! Compiled to '%s%s' executable.\n", strchr(output, '/') ? "" : "./", output);
+    } else if (result < 0) {
+        printf("\nCould not run %s.\n", compile->cc);
+    } else {
+        printf("\nGCC compilation failed.\n");
+    }
+}
+
+// Copies a cached build to the requested outputs. Returns 0 if the entry
+// turned out to be incomplete, so the caller builds from scratch.
+static int use_cached_build(const CacheEntry* entry, const Options* options) {
+    size_t c_length, binary_length;
+    char* c_code = cache_read(entry, "out.c", &c_length);
+    char* binary = cache_read(entry, "bin", &binary_length);
+    int ok = c_code && binary;
+    if (ok) {
+        printf("--- Using cached build ---\n");
+        printf("Transpiled C code:\n---\n%s---\n", c_code);
+        if (options->emit_c && !write_file(options->emit_c, c_code, c_length)) {
+            printf("Error: could not write %s\n", options->emit_c);
+        }
+        int written = write_file_atomic(options->compile.output, binary, binary_length, 0755);
+        report_compile_result(written ? 0 : 1, &options->compile);
+    }
+    free(c_code);
+    free(binary);
+    return ok;
+}
+
+// The single-file path: transpile, print and compile, or reuse a cached
+// build of the same source with the same compiler setup.
+static int run_single(const Options* options) {
+    TranspileStats stats = TRANSPILE_STATS_INIT;
+    double start = monotonic_ms();
+    SourceBuffer source;
+    if (!read_file(options->inputs[0], &source)) return 74;
+    stats.read_ms = monotonic_ms() - start;
+    stats.source_bytes = source.length;
+    CacheEntry entry;
+    if (options->cache_dir) {
+        cache_entry_init(&entry, options->cache_dir, source.data, source.length, &options->compile);
+        if (cache_entry_valid(&entry) && use_cached_build(&entry, options)) {
+            free_source(&source);
+            free_cache_entry(&entry);
+            stats.cached = 1;
+            if (options->stats) write_stats(options->stats, &stats);
+            return 0;
+        }
+    }
+
+    printf("--- Tokenizing & Transpiling ---\n");
+    char* c_code = options->stats ? transpile_with_stats(source.data, source.length, &stats)
+                                  : transpile_to_string(source.data, source.length);
+    free_source(&source);
+    if (!c_code) {
+        printf("Failed to transpile due to parsing errors.\n");
+        if (options->cache_dir) free_cache_entry(&entry);
+        if (options->stats) write_stats(options->stats, &stats);
+        return 1;
+    }
+    start = monotonic_ms();
+    printf("Transpiled C code:\n---\n%s---\n", c_code);
+    size_t c_length = strlen(c_code);
+    if (options->emit_c && !write_file(options->emit_c, c_code, c_length)) {
+        printf("Error: could not write %s\n", options->emit_c);
+    }
+    stats.emit_ms = monotonic_ms() - start;
+
+    printf("\n--- Compiling with GCC ---\n");
+    fflush(stdout);
+    start = monotonic_ms();
+    int result = compile_c(c_code, c_length, &options->compile);
+    stats.compile_ms = monotonic_ms() - start;
+    stats.compile_status = result;
+    report_compile_result(result, &options->compile);
+    if (options->stats) {
+        fflush(stdout);
+        write_stats(options->stats, &stats);
+    }
+
+    if (options->cache_dir) {
+        size_t binary_length;
+        char* binary = result == 0 ? read_whole_file(options->compile.output, &binary_length) : NULL;
+        if (binary) cache_store(&entry, c_code, c_length, binary, binary_length);
+        free(binary);
+        free_cache_entry(&entry);
+    }
+    free(c_code);
+    return 0;
+}
+
+// "yoda run": compiles the program to bytecode and runs it, exiting with
+// main's return value.
+static int run_script(const Options* options) {
+    SourceBuffer source;
+    if (!read_file(options->inputs[0], &source)) return 74;
+    VmProgram vm;
+    int main_function = compile_program(&vm, source.data, source.length);
+    TieredBuild build;
+    int tiered = options->tiered && main_function >= 0 && start_tiered_build(&build, &vm, source.data, source.length);
+    int result = 1;
+    if (main_function >= 0 && !run_vm(&vm, main_function, tiered ? &build.promoted : NULL, &result)) result = 1;
+    fflush(stdout);
+    if (tiered) finish_tiered_build(&build);
+    free_vm_program(&vm);
+    free_source(&source);
+    return result & 0xFF;
+}
+
+// --native: compiles the program through the VM's bytecode to an x86-64
+// executable, writing it without running a C compiler.
+static int build_native(const Options* options) {
+    SourceBuffer source;
+    if (!read_file(options->inputs[0], &source)) return 74;
+    printf("--- Compiling to x86-64 ---\n");
+    VmProgram vm;
+    int main_function = compile_program(&vm, source.data, source.length);
+    size_t length;
+    uint8_t* executable = main_function >= 0 ? native_executable(&vm, main_function, &length) : NULL;
+    int status = 1;
+    if (executable && write_file_atomic(options->compile.output, (const char*)executable, length, 0755)) {
+        report_compile_result(0, &options->compile);
+        status = 0;
+    } else if (executable) {
+        printf("Error: could not write %s\n", options->compile.output);
+    } else {
+        printf("Failed to compile natively.\n");
+    }
+    free(executable);
+    free_vm_program(&vm);
+    free_source(&source);
+    return status;
+}
+
+// --- Watch Mode ---
+
+// A watched file remembers, for its last successful transpile, the byte
+// range and emitted C of every top-level declaration. On a change only the
+// declarations touching the edited region are re-lexed and re-parsed; the
+// rest reuse their C (declarations after the edit just shift by the size
+// difference), and the whole program is stitched and recompiled.
+typedef struct {
+    size_t start;   // source bytes [start, end) of the declaration
+    size_t end;
+    char* output;   // C emitted for it
+    int directives; // preprocessor lines in it
+    size_t name;    // source bytes [name, name + name_length) of the function it declares
+    int name_length; // 0 if it declares none, -1 if it holds several declarations
+} WatchItem;
+
+typedef struct {
+    const char* path;
+    const char* output_name;
+    char* source;   // source of the last successful transpile
+    size_t length;
+    WatchItem* items;
+    int count;
+} WatchedFile;
+
+// Lexes source from byte lo up to the start of item *first_kept (the first
+// declaration reused after the edit), shifted by delta. If a comment,
+// string or token runs across that boundary the item is no longer intact,
+// so *first_kept advances until the lexer stops exactly on a boundary.
+static TokenList lex_dirty_region(const char* source, size_t length, size_t lo, const WatchedFile* file,
+                           int* first_kept, ptrdiff_t delta, const YodaDiagnostics* diagnostics) {
+    TokenList tokens = new_token_list(source, length - lo);
+    BracketStack parens = {NULL, 0, 0}, braces = {NULL, 0, 0};
+    SymbolTable symbols = {NULL, 0, 0, 0, 0, 0};
+    Lexer lexer;
+    init_lexer(&lexer, source, length);
+    lexer.current = source + lo;
+    lexer.diagnostics = diagnostics;
+    int kept = *first_kept;
+    size_t hi = kept < file->count ? file->items[kept].start + delta : length;
+    for (;;) {
+        Token token = next_token(&lexer);
+        while (kept < file->count && token.offset != hi && token.offset + token.length > hi) {
+            kept++;
+            hi = kept < file->count ? file->items[kept].start + delta : length;
+        }
+        if (token.type != TOKEN_EOF && token.offset == hi) token = (Token){TOKEN_EOF, -1, 0, hi};
+        int open = pair_bracket(&parens, &braces, token.type, tokens.count, NULL);
+        if (open >= 0) tokens.partners[open] = tokens.count;
+        int symbol = token_symbol(&symbols, source, token, NULL);
+        if (symbol == SYMBOL_OUT_OF_MEMORY) abort();
+        add_token(&tokens, token, open >= 0 ? open : -1, symbol);
+        if (token.type == TOKEN_EOF) break;
+    }
+    free(parens.positions);
+    free(braces.positions);
+    free(symbols.slots);
+    *first_kept = kept;
+    return tokens;
+}
+
+static int count_directives(const TokenList* tokens, int start, int end) {
+    int directives = 0;
+    for (int i = start; i < end; i++) directives += tokens->types[i] == TOKEN_PREPROCESSOR;
+    return directives;
+}
+
+// Position of the name of the function that tokens [start, end) declare:
+// -1 for a preprocessor line, -2 for anything but a single declaration.
+static int declared_name(const TokenList* tokens, int start, int end) {
+    if (tokens->types[start] == TOKEN_PREPROCESSOR && end == start + 1) return -1;
+    int close = tokens->partners[start];
+    if (tokens->types[start] == TOKEN_LPAREN && close >= 0 && close + 3 < end &&
+        tokens->types[close + 3] == TOKEN_LBRACE && tokens->partners[close + 3] == end - 1) return close + 1;
+    return -2;
+}
+
+// Whether tokens declare the same functions, in the same order, as items
+// [first, last) of file did. Later declarations read "(x)f" by them.
+static int same_functions(const TokenList* tokens, const WatchedFile* file, int first, int last) {
+    FunctionChunk* chunks;
+    int count = split_top_level(tokens, 1, &chunks);
+    int same = 1, i = first;
+    for (int c = 0; c < count && same; c++) {
+        int name = declared_name(tokens, chunks[c].start, chunks[c].end);
+        if (name == -1) continue;
+        while (i < last && file->items[i].name_length == 0) i++;
+        same = name >= 0 && i < last && file->items[i].name_length == (int)tokens->lengths[name] &&
+               memcmp(file->source + file->items[i].name, tokens->source + tokens->offsets[name], tokens->lengths[name]) == 0;
+        i++;
+    }
+    while (same && i < last && file->items[i].name_length == 0) i++;
+    free(chunks);
+    return same && i >= last;
+}
+
+// Applies the preprocessor lines in source bytes [start, end) to macros and
+// declares the functions defined there (the names after a top-level ')').
+static void replay_declarations(MacroTable* macros, const char* source, size_t start, size_t end) {
+    Lexer lexer;
+    init_lexer(&lexer, source + start, end - start);
+    lexer.diagnostics = &quiet_diagnostics;
+    int depth = 0;
+    TokenType previous = TOKEN_EOF;
+    for (Token t = next_token(&lexer); t.type != TOKEN_EOF; t = next_token(&lexer)) {
+        if (t.type == TOKEN_PREPROCESSOR) apply_directive(macros, NULL, source + start + t.offset, t.length);
+        if (t.type == TOKEN_IDENTIFIER && depth == 0 && previous == TOKEN_RPAREN &&
+            !declare_function(macros, NULL, source + start + t.offset, t.length)) abort();
+        depth += (t.type == TOKEN_LPAREN || t.type == TOKEN_LBRACE) - (t.type == TOKEN_RPAREN || t.type == TOKEN_RBRACE);
+        previous = t.type;
+    }
+}
+
+// Transpiles the declarations in tokens one by one into items, starting
+// from the #defines in macros. Returns the number of items, or -1 on a
+// parse error. If a declaration's parse runs past its boundary (malformed
+// input) the region becomes a single item.
+static int parse_items(TokenList tokens, MacroTable* macros, const YodaDiagnostics* diagnostics, WatchItem** items_out) {
+    FunctionChunk* chunks;
+    int count = split_top_level(&tokens, 1, &chunks);
+    WatchItem* items = malloc((count > 0 ? count : 1) * sizeof(WatchItem));
+    MacroTable macros_at_start;
+    copy_macro_table(&macros_at_start, macros);
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        Parser p = {.tokens = tokens, .current_token_pos = chunks[i].start, .diagnostics = diagnostics,
+                    .macros = macros};
+        char* output = parse_program(&p, chunks[i].end);
+        if (!output || p.current_token_pos != chunks[i].end) {
+            for (int j = 0; j < n; j++) free(items[j].output);
+            free(output);
+            n = -1;
+            if (output) {
+                Parser whole = {.tokens = tokens, .diagnostics = diagnostics, .macros = &macros_at_start};
+                output = parse_program(&whole, INT_MAX);
+                if (output) {
+                    items[0] = (WatchItem){tokens.offsets[0], tokens.offsets[tokens.count - 1], output,
+                                           count_directives(&tokens, 0, tokens.count), 0, -1};
+                    n = 1;
+                }
+            }
+            break;
+        }
+        Token first = get_token(&tokens, chunks[i].start);
+        Token last = get_token(&tokens, chunks[i].end - 1);
+        int name = declared_name(&tokens, chunks[i].start, chunks[i].end);
+        int name_length = name >= 0 ? (int)tokens.lengths[name] : name == -1 ? 0 : -1;
+        items[n++] = (WatchItem){first.offset, last.offset + last.length, output,
+                                 count_directives(&tokens, chunks[i].start, chunks[i].end),
+                                 name >= 0 ? tokens.offsets[name] : 0, name_length};
+    }
+    free_macro_table(&macros_at_start, NULL);
+    free(chunks);
+    if (n < 0) free(items);
+    else *items_out = items;
+    return n;
+}
+
+// Re-transpiles the part of file that differs from source, or all of it
+// when everything is set.
+static int update_watched_region(WatchedFile* file, char* source, size_t length, int everything,
+                          const YodaDiagnostics* diagnostics) {
+    size_t common = everything ? 0 : length < file->length ? length : file->length;
+    size_t prefix = 0;
+    while (prefix < common && source[prefix] == file->source[prefix]) prefix++;
+    size_t suffix = 0;
+    while (suffix < common - prefix && source[length - 1 - suffix] == file->source[file->length - 1 - suffix]) suffix++;
+    ptrdiff_t delta = (ptrdiff_t)length - (ptrdiff_t)file->length;
+
+    // Declarations ending before the first changed byte are kept as they are;
+    // those starting inside the common suffix are kept, shifted by delta.
+    int first_dirty = 0;
+    while (first_dirty < file->count && file->items[first_dirty].end < prefix) first_dirty++;
+    int first_kept = first_dirty;
+    while (first_kept < file->count && file->items[first_kept].start < file->length - suffix) first_kept++;
+    size_t lo = first_dirty > 0 ? file->items[first_dirty - 1].end : 0;
+
+    TokenList tokens = lex_dirty_region(source, length, lo, file, &first_kept, delta, diagnostics);
+
+    // The C of a declaration depends on the #defines and functions before it,
+    // so a change to a directive or to which functions exist re-parses
+    // everything after it.
+    int declarations_changed = count_directives(&tokens, 0, tokens.count) > 0;
+    for (int i = first_dirty; i < first_kept; i++) declarations_changed |= file->items[i].directives > 0;
+    if (!declarations_changed && first_kept < file->count) declarations_changed = !same_functions(&tokens, file, first_dirty, first_kept);
+    if (declarations_changed && first_kept < file->count) {
+        free_tokens(&tokens);
+        first_kept = file->count;
+        tokens = lex_dirty_region(source, length, lo, file, &first_kept, delta, diagnostics);
+    }
+    MacroTable macros = {NULL, 0, 0, 0};
+    for (int i = 0; i < first_dirty; i++) {
+        const WatchItem* item = &file->items[i];
+        if (item->name_length > 0 && !declare_function(&macros, NULL, source + item->name, item->name_length)) abort();
+        if (item->directives > 0 || item->name_length < 0) replay_declarations(&macros, source, item->start, item->end);
+    }
+
+    WatchItem* dirty;
+    int num_dirty = parse_items(tokens, &macros, diagnostics, &dirty);
+    free_macro_table(&macros, NULL);
+    free_tokens(&tokens);
+    if (num_dirty < 0) return -1;
+
+    int count = first_dirty + num_dirty + (file->count - first_kept);
+    WatchItem* items = malloc((count > 0 ? count : 1) * sizeof(WatchItem));
+    if (first_dirty > 0) memcpy(items, file->items, first_dirty * sizeof(WatchItem));
+    if (num_dirty > 0) memcpy(items + first_dirty, dirty, num_dirty * sizeof(WatchItem));
+    for (int i = first_kept; i < file->count; i++) {
+        WatchItem item = file->items[i];
+        items[first_dirty + num_dirty + (i - first_kept)] = (WatchItem){item.start + delta, item.end + delta, item.output,
+                                                                        item.directives, item.name + delta, item.name_length};
+    }
+    for (int i = first_dirty; i < first_kept; i++) free(file->items[i].output);
+    free(dirty);
+    free(file->items);
+    free(file->source);
+    file->items = items;
+    file->count = count;
+    file->source = source;
+    file->length = length;
+    return num_dirty;
+}
+
+// Brings file up to date with source (taking ownership of it on success).
+// Returns the number of declarations re-parsed, or -1 on a parse error, in
+// which case the previous state is kept.
+//
+// An edit can change what the unchanged text around it means (removing a
+// '}' pulls the following declarations into the edited one), so when the
+// edited region does not parse on its own the whole file is re-parsed
+// before reporting errors.
+static int update_watched_file(WatchedFile* file, char* source, size_t length) {
+    int reparsed = update_watched_region(file, source, length, 0, &quiet_diagnostics);
+    if (reparsed < 0) reparsed = update_watched_region(file, source, length, 1, NULL);
+    return reparsed;
+}
+
+static char* stitch_watch_output(const WatchedFile* file, size_t* length_out) {
+    size_t total = 0;
+    for (int i = 0; i < file->count; i++) total += strlen(file->items[i].output);
+    char* output = malloc(total + 1);
+    size_t size = 0;
+    for (int i = 0; i < file->count; i++) {
+        size_t len = strlen(file->items[i].output);
+        memcpy(output + size, file->items[i].output, len);
+        size += len;
+    }
+    output[size] = '\0';
+    *length_out = size;
+    return output;
+}
+
+static void rebuild_watched_file(WatchedFile* file, const Options* options) {
+    size_t length;
+    char* source = read_whole_file(file->path, &length);
+    if (!source) { printf("[watch] Could not read \"%s\".\n", file->path); return; }
+    if (file->source && length == file->length && memcmp(source, file->source, length) == 0) {
+        free(source);
+        return;
+    }
+    double start = monotonic_ms();
+    int reparsed = update_watched_file(file, source, length);
+    double elapsed = monotonic_ms() - start;
+    if (reparsed < 0) {
+        free(source);
+        printf("[watch] %s: failed to transpile due to parsing errors.\n", file->path);
+        fflush(stdout);
+        return;
+    }
+    printf("[watch] %s: re-parsed %d of %d declarations in %.2f ms\n", file->path, reparsed, file->count, elapsed);
+
+    size_t c_length;
+    char* c_code = stitch_watch_output(file, &c_length);
+    if (options->emit_c && options->num_inputs == 1 && !write_file(options->emit_c, c_code, c_length)) {
+        printf("Error: could not write %s\n", options->emit_c);
+    }
+    CompileOptions compile = options->compile;
+    compile.output = file->output_name;
+    fflush(stdout);
+    report_compile_result(compile_c(c_code, c_length, &compile), &compile);
+    fflush(stdout);
+    free(c_code);
+}
+
+#ifdef __linux__
+// Directory part of a path ("." if none) and its final component.
+static char* path_directory(const char* path) {
+    const char* slash = strrchr(path, '/');
+    if (!slash) return strdup(".");
+    if (slash == path) return strdup("/");
+    return strndup(path, slash - path);
+}
+
+static const char* path_basename(const char* path) {
+    const char* slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+// Watches the directories holding the inputs rather than the files
+// themselves, so editors that save by writing a new file and renaming it
+// over the old one are still noticed.
+static int run_watch(const Options* options) {
+    int count = options->num_inputs;
+    WatchedFile* files = calloc(count, sizeof(WatchedFile));
+    int* dir_watches = malloc(count * sizeof(int));
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) { printf("Error: could not start inotify.\n"); free(files); free(dir_watches); return 1; }
+
+    for (int i = 0; i < count; i++) {
+        files[i].path = options->inputs[i];
+        files[i].output_name = count == 1 ? strdup(options->compile.output) : c_output_path(options->inputs[i]);
+        if (count > 1) ((char*)files[i].output_name)[strlen(files[i].output_name) - 2] = '\0';
+        char* dir = path_directory(files[i].path);
+        dir_watches[i] = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+        if (dir_watches[i] < 0) printf("[watch] Could not watch \"%s\".\n", dir);
+        free(dir);
+        rebuild_watched_file(&files[i], options);
+    }
+    printf("[watch] Watching %d file%s for changes. Press Ctrl-C to stop.\n", count, count == 1 ? "" : "s");
+    fflush(stdout);
+
+    char* changed = calloc(count, 1);
+    char buffer[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(fd, buffer, sizeof(buffer));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        // Editors often produce a burst of events per save; collect them
+        // all before rebuilding.
+        for (;;) {
+            for (char* p = buffer; p < buffer + n;) {
+                struct inotify_event* event = (struct inotify_event*)p;
+                for (int i = 0; i < count; i++) {
+                    if (event->wd == dir_watches[i] && event->len > 0 &&
+                        strcmp(event->name, path_basename(files[i].path)) == 0) changed[i] = 1;
+                }
+                p += sizeof(struct inotify_event) + event->len;
+            }
+            struct pollfd pfd = {fd, POLLIN, 0};
+            if (poll(&pfd, 1, 20) <= 0) break;
+            n = read(fd, buffer, sizeof(buffer));
+            if (n <= 0) break;
+        }
+        for (int i = 0; i < count; i++) {
+            if (changed[i]) rebuild_watched_file(&files[i], options);
+            changed[i] = 0;
+        }
+    }
+    close(fd);
+    return 1;
+}
+#else
+static int run_watch(const Options* options) {
+    (void)options;
+    printf("Error: --watch needs inotify, which this platform does not have.\n");
+    return 1;
+}
+#endif
+
+// --- Server Mode ---
+
+// Arena backing the library's allocator for one server worker. Memory is
+// handed out by bumping a pointer and released all at once between
+// requests; after a request that needed more than one block the blocks are
+// merged, so once the largest request has been seen nothing is allocated.
+#define ARENA_ALIGN 16
+#define ARENA_INITIAL_SIZE (1 << 20)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    char* data;
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* blocks; // the current block first
+    void* last;         // most recent allocation, which can grow in place
+} Arena;
+
+static size_t arena_round(size_t size) { return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1); }
+
+static ArenaBlock* new_arena_block(size_t size) {
+    ArenaBlock* block = malloc(sizeof(ArenaBlock));
+    if (!block) return NULL;
+    block->data = malloc(size);
+    if (!block->data) { free(block); return NULL; }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+// Every allocation is preceded by a header holding its size.
+static void* arena_alloc(Arena* arena, size_t size) {
+    size_t needed = ARENA_ALIGN + arena_round(size);
+    ArenaBlock* block = arena->blocks;
+    if (!block || block->size - block->used < needed) {
+        size_t block_size = block ? block->size * 2 : ARENA_INITIAL_SIZE;
+        if (block_size < needed) block_size = needed;
+        ArenaBlock* grown = new_arena_block(block_size);
+        if (!grown) return NULL;
+        grown->next = block;
+        arena->blocks = block = grown;
+    }
+    char* header = block->data + block->used;
+    *(size_t*)header = size;
+    block->used += needed;
+    arena->last = header + ARENA_ALIGN;
+    return arena->last;
+}
+
+// YodaAllocator callback. Frees are no-ops; the arena is reset per request.
+static void* arena_realloc(void* ctx, void* ptr, size_t size) {
+    Arena* arena = ctx;
+    if (size == 0) return NULL;
+    if (!ptr) return arena_alloc(arena, size);
+    size_t* old_size = (size_t*)((char*)ptr - ARENA_ALIGN);
+    ArenaBlock* block = arena->blocks;
+    if (ptr == arena->last) {
+        size_t start = (char*)ptr - block->data;
+        if (start + arena_round(size) <= block->size) {
+            block->used = start + arena_round(size);
+            *old_size = size;
+            return ptr;
+        }
+    }
+    void* grown = arena_alloc(arena, size);
+    if (grown) memcpy(grown, ptr, *old_size < size ? *old_size : size);
+    return grown;
+}
+
+static void arena_reset(Arena* arena) {
+    ArenaBlock* block = arena->blocks;
+    arena->last = NULL;
+    if (!block) return;
+    if (block->next) {
+        size_t total = 0;
+        while (block) {
+            ArenaBlock* next = block->next;
+            total += block->size;
+            free(block->data);
+            free(block);
+            block = next;
+        }
+        arena->blocks = new_arena_block(total);
+        return;
+    }
+    block->used = 0;
+}
+
+static void free_arena(Arena* arena) {
+    arena->last = NULL;
+    ArenaBlock* block = arena->blocks;
+    while (block) {
+        ArenaBlock* next = block->next;
+        free(block->data);
+        free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+}
+
+// A growable byte buffer kept by a worker across requests.
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} ByteBuffer;
+
+static int reserve_bytes(ByteBuffer* buffer, size_t capacity) {
+    if (capacity <= buffer->capacity) return 1;
+    size_t grown = buffer->capacity ? buffer->capacity : 4096;
+    while (grown < capacity) grown *= 2;
+    char* data = realloc(buffer->data, grown);
+    if (!data) return 0;
+    buffer->data = data;
+    buffer->capacity = grown;
+    return 1;
+}
+
+static void append_bytes(ByteBuffer* buffer, const char* data, size_t length) {
+    if (!reserve_bytes(buffer, buffer->length + length)) return;
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+static void sink_to_buffer(void* buffer, const char* data, size_t length) { append_bytes(buffer, data, length); }
+
+static void diagnostic_to_buffer(void* buffer, const char* message) {
+    append_bytes(buffer, message, strlen(message));
+    append_bytes(buffer, "\n", 1);
+}
+
+// Everything a worker reuses from one request to the next.
+typedef struct {
+    Arena arena;
+    ByteBuffer request;
+    ByteBuffer output;
+    ByteBuffer diagnostics;
+    char input[4096];       // bytes read from the connection but not yet used
+    size_t input_start;
+    size_t input_end;
+} ServerWorker;
+
+typedef struct {
+    int listen_fd;
+    ServerWorker* workers;
+} Server;
+
+// Reads exactly length bytes from the connection. Returns 0 on EOF or error.
+static int read_exact(ServerWorker* worker, int fd, char* data, size_t length) {
+    while (length > 0) {
+        if (worker->input_start == worker->input_end) {
+            ssize_t n = read(fd, worker->input, sizeof(worker->input));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return 0;
+            worker->input_start = 0;
+            worker->input_end = n;
+        }
+        size_t available = worker->input_end - worker->input_start;
+        size_t take = available < length ? available : length;
+        memcpy(data, worker->input + worker->input_start, take);
+        worker->input_start += take;
+        data += take;
+        length -= take;
+    }
+    return 1;
+}
+
+static int write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t n = send(fd, data, length, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        data += n;
+        length -= n;
+    }
+    return 1;
+}
+
+// Requests and replies are framed by a decimal length on its own line:
+//   request:  <length>\n<source bytes>
+//   reply:    ok <length>\n<C code>   or   error <length>\n<diagnostics>
+// A connection may carry any number of requests.
+#define SERVER_MAX_REQUEST (256u << 20)
+
+static int read_request_length(ServerWorker* worker, int fd, size_t* length) {
+    *length = 0;
+    for (int digits = 0;; digits++) {
+        char c;
+        if (!read_exact(worker, fd, &c, 1)) return 0;
+        if (c == '\n') return digits > 0;
+        if (c < '0' || c > '9' || digits >= 10) return 0;
+        *length = *length * 10 + (c - '0');
+    }
+}
+
+static int send_reply(int fd, const char* kind, const char* data, size_t length) {
+    char header[32];
+    int header_length = snprintf(header, sizeof(header), "%s %zu\n", kind, length);
+    return write_all(fd, header, header_length) && write_all(fd, data, length);
+}
+
+static void serve_connection(ServerWorker* worker, int fd) {
+    worker->input_start = worker->input_end = 0;
+    size_t length;
+    while (read_request_length(worker, fd, &length)) {
+        if (length > SERVER_MAX_REQUEST || !reserve_bytes(&worker->request, length)) {
+            static const char message[] = "Request too large.\n";
+            send_reply(fd, "error", message, sizeof(message) - 1);
+            return;
+        }
+        if (!read_exact(worker, fd, worker->request.data, length)) return;
+
+        worker->output.length = 0;
+        worker->diagnostics.length = 0;
+        YodaSink sink = {sink_to_buffer, &worker->output};
+        YodaDiagnostics diagnostics = {diagnostic_to_buffer, &worker->diagnostics};
+        YodaAllocator allocator = {arena_realloc, &worker->arena};
+        YodaStatus status = yoda_transpile_with_allocator(worker->request.data, length, &sink, &diagnostics, &allocator);
+        arena_reset(&worker->arena);
+
+        int sent;
+        if (status == YODA_OK) {
+            sent = send_reply(fd, "ok", worker->output.data, worker->output.length);
+        } else {
+            if (status == YODA_OUT_OF_MEMORY) diagnostic_to_buffer(&worker->diagnostics, "Out of memory.");
+            sent = send_reply(fd, "error", worker->diagnostics.data, worker->diagnostics.length);
+        }
+        if (!sent) return;
+    }
+}
+
+// Each worker accepts and serves one client at a time, so up to -j
+// clients are served concurrently. The loop never ends on its own.
+static void server_worker(void* ctx, int index) {
+    Server* server = ctx;
+    ServerWorker* worker = &server->workers[index];
+    for (;;) {
+        int fd = accept(server->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            printf("[serve] accept failed: %s\n", strerror(errno));
+            return;
+        }
+        serve_connection(worker, fd);
+        close(fd);
+    }
+}
+
+static int run_server(const char* path, int num_threads) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        printf("Error: socket path \"%s\" is too long.\n", path);
+        return 1;
+    }
+    strcpy(address.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) { printf("Error: could not create a socket.\n"); return 1; }
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, 128) < 0) {
+        printf("Error: could not listen on \"%s\": %s\n", path, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    printf("[serve] Listening on %s with %d worker%s.\n", path, num_threads, num_threads == 1 ? "" : "s");
+    fflush(stdout);
+
+    Server server = {fd, calloc(num_threads, sizeof(ServerWorker))};
+    run_parallel(num_threads, num_threads, server_worker, &server);
+    for (int i = 0; i < num_threads; i++) {
+        free_arena(&server.workers[i].arena);
+        free(server.workers[i].request.data);
+        free(server.workers[i].output.data);
+        free(server.workers[i].diagnostics.data);
+    }
+    free(server.workers);
+    close(fd);
+    unlink(path);
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
+    Options options;
+    if (parse_options(argc, argv, &options) != 0) return 1;
+    int status;
+    if (options.bench_generate) {
+        size_t length;
+        char* program = generate_bench_program(&options.bench_shape, &length);
+        status = write_file(options.bench_generate, program, length) ? 0 : 1;
+        if (status) printf("Error: could not write %s\n", options.bench_generate);
+        free(program);
+    } else if (options.run) {
+        status = run_script(&options);
+    } else if (options.native) {
+        status = build_native(&options);
+    } else if (options.bench) {
+        status = run_bench(&options.bench_shape, options.bench_repeat, options.bench_save, options.bench_compare);
+    } else if (options.serve) {
+        status = run_server(options.serve, options.num_threads > 0 ? options.num_threads : 4);
+    } else if (options.watch) {
+        status = run_watch(&options);
+    } else if (options.num_threads > 0 || options.num_inputs > 1) {
+        status = run_batch(options.inputs, options.num_inputs, options.num_threads > 0 ? options.num_threads : 1,
+                           options.cache_dir);
+    } else {
+        status = run_single(&options);
+    }
+    free_options(&options);
+    return status;
+}
+#endif
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Regression tests. Usage: tests/run.sh [path to yoda]
+# Without an argument the transpiler is built from Ctranspiler.c first.
+# Prints one line per failing test and exits with the number of failures.
+
+if [ $# -gt 0 ]; then
+    yoda=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+fi
+cd "$(dirname "$0")/.." || exit 1
+work=$(mktemp -d /tmp/yoda-tests-XXXXXX) || exit 1
+trap 'rm -rf "$work"' EXIT
+
+if [ $# = 0 ]; then
+    yoda=$work/yoda
+    gcc -O2 -pthread Ctranspiler.c -o "$yoda" || exit 1
+fi
+
+failures=0
+fail() {
+    echo "FAIL: $1"
+    failures=$((failures + 1))
+}
+
+# Each cases/<name>.ydc is compiled with gcc and must print <name>.out.
+for source in tests/cases/*.ydc; do
+    name=$(basename "$source" .ydc)
+    if ! "$yoda" -o "$work/$name" "$source" > /dev/null; then
+        fail "$name: does not compile"
+    elif ! "$work/$name" | cmp -s - "tests/cases/$name.out"; then
+        fail "$name: unexpected output"
+    fi
+done
+
+# A native executable bigger than 2 MB: its writable segment must not be
+# mapped over the code.
+awk 'BEGIN {
+    for (i = 0; i < 8000; i++) {
+        printf "(a int)f%d int {\n", i
+        printf "    (\"f%d %%d, with a long enough format string to pad the code\\n\", a)printf;\n", i
+        printf "    return a + %d;\n}\n\n", i
+    }
+    printf "()main int {\n    0 = sum int;\n"
+    for (i = 0; i < 8000; i++) printf "    sum = sum + (%d)f%d;\n", i, i
+    printf "    (\"%%d\\n\", sum)printf;\n    return 7;\n}\n"
+}' > "$work/large.ydc"
+"$yoda" run "$work/large.ydc" > "$work/large.vm"; vm_status=$?
+if ! "$yoda" --native -o "$work/large" "$work/large.ydc" > /dev/null; then
+    fail "native: large program does not compile"
+else
+    "$work/large" > "$work/large.native"; native_status=$?
+    if [ $native_status != $vm_status ] || ! cmp -s "$work/large.vm" "$work/large.native"; then
+        fail "native: large program (exit $native_status, expected $vm_status)"
+    fi
+fi
+
+[ $failures = 0 ] && echo "All tests passed."
+exit $failures
@@ -0,0 +1,49 @@
+#ifndef YODA_H
+#define YODA_H
+
+// Library interface of the Yoda transpiler. Build Ctranspiler.c with
+// -DYODA_NO_MAIN to link it into another program; that object defines
+// nothing but the functions below.
+//
+// The calls are reentrant: every call keeps its state on the stack or in
+// memory from the caller's allocator, and nothing is printed. The only
+// data shared between calls is the read-only keyword table, built once.
+
+#include <stddef.h>
+
+// Receives the generated C in order, in pieces of any size.
+typedef struct {
+    void (*write)(void* ctx, const char* data, size_t length);
+    void* ctx;
+} YodaSink;
+
+// Receives each tokenizer or parser error as one line without a trailing
+// newline.
+typedef struct {
+    void (*report)(void* ctx, const char* message);
+    void* ctx;
+} YodaDiagnostics;
+
+// All memory goes through realloc; a size of 0 frees ptr. Returning NULL
+// for a nonzero size makes the transpile fail with YODA_OUT_OF_MEMORY.
+typedef struct {
+    void* (*realloc)(void* ctx, void* ptr, size_t size);
+    void* ctx;
+} YodaAllocator;
+
+typedef enum {
+    YODA_OK,
+    YODA_PARSE_ERROR,
+    YODA_OUT_OF_MEMORY
+} YodaStatus;
+
+// Transpiles source (length bytes, need not be NUL-terminated) to C.
+// Output is written to sink as each top-level declaration completes, so on
+// an error the sink may already hold the declarations before it. A NULL
+// sink or diagnostics discards that stream; a NULL allocator uses libc.
+YodaStatus yoda_transpile(const char* source, size_t length, const YodaSink* sink,
+                          const YodaDiagnostics* diagnostics);
+YodaStatus yoda_transpile_with_allocator(const char* source, size_t length, const YodaSink* sink,
+                                         const YodaDiagnostics* diagnostics, const YodaAllocator* allocator);
+
+#endif